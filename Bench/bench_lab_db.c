@@ -0,0 +1,582 @@
+// benchmark of lab_db: generates a seeded workload, replays it through the database
+// and prints throughput, latency percentiles per command type and peak RSS as JSON
+#define LAB_DB_NO_MAIN
+#include "../DataBase/lab_db.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define CMD_TYPES 6
+#define DEFAULT_ROWS 100000
+#define DEFAULT_COMMANDS 100000
+#define DEFAULT_SEED 1
+#define MECHANICS 300
+#define DRIVERS 3000
+#define MODELS 12
+
+static const char* cmd_names[CMD_TYPES] = { "insert", "select", "update", "delete", "uniq", "sort" };
+
+// relative weights of the commands that follow the initial inserts
+static const int default_mix[CMD_TYPES] = { 400, 350, 150, 98, 1, 1 };
+
+static const char* models[MODELS] = {
+    "KamAZ", "GAZ", "ZIL", "MAZ", "Ural", "PAZ", "LiAZ", "UAZ", "Volvo", "Scania", "MAN", "Iveco"
+};
+
+static const char* surnames[] = {
+    "Ivanov", "Petrov", "Sidorov", "Smirnov", "Kuznetsov", "Popov", "Vasiliev", "Sokolov",
+    "Mikhailov", "Novikov", "Fedorov", "Morozov", "Volkov", "Alekseev", "Lebedev", "Semenov",
+    "Egorov", "Pavlov", "Kozlov", "Stepanov", "Nikolaev", "Orlov", "Andreev", "Makarov",
+    "Nikitin", "Zakharov", "Zaitsev", "Soloviev", "Borisov", "Yakovlev"
+};
+
+#define SURNAMES ((int)(sizeof(surnames) / sizeof(surnames[0])))
+
+static const char* statuses[] = { "well", "wearlow", "wearhigh", "broken", "notcheck" };
+
+// share of each status in percent, most units are fine
+static const int status_weights[] = { 55, 20, 12, 8, 5 };
+
+static const char* sort_fields[] = { "unit_id", "unit_model", "car_id", "chk_date", "mechanic", "driver" };
+
+typedef struct {
+    long rows;
+    long commands;
+    uint64_t seed;
+    int mix[CMD_TYPES];
+    int threads;
+    const char* exe;
+    const char* dir;
+} BenchOptions;
+
+// latencies of one command type in nanoseconds
+typedef struct {
+    uint64_t* ns;
+    long count;
+    long cap;
+} Latencies;
+
+// state of the workload generator, ids are handed out in order and picked back at random
+typedef struct {
+    uint64_t rng;
+    long next_id;
+} Generator;
+
+// splitmix64, the same sequence on every platform for the same seed
+static uint64_t next_random(Generator* g) {
+    uint64_t z = (g->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static long random_below(Generator* g, long n) {
+    return (long)(next_random(g) % (uint64_t)n);
+}
+
+// index in [0, n) where small indexes come up much more often, like regular staff
+static long random_skewed(Generator* g, long n) {
+    double u = (double)(next_random(g) >> 11) / (double)(1ULL << 53);
+    return (long)(u * u * n);
+}
+
+static int random_weighted(Generator* g, const int* weights, int count) {
+    int total = 0;
+    for (int i = 0; i < count; i++)
+        total += weights[i];
+
+    long r = random_below(g, total);
+    for (int i = 0; i < count; i++) {
+        if (r < weights[i])
+            return i;
+        r -= weights[i];
+    }
+
+    return count - 1;
+}
+
+static long random_id(Generator* g) {
+    return g->next_id ? random_below(g, g->next_id) : 0;
+}
+
+static void put_person(FILE* f, long person) {
+    fprintf(f, "\"%s.%c.%c.\"", surnames[person % SURNAMES],
+        "ABDEGIKLMNOPRSTV"[(person / SURNAMES) % 16], "ABDEGIKLMNOPRSTV"[(person / SURNAMES / 16) % 16]);
+}
+
+static void put_carnum(FILE* f, Generator* g) {
+    const char* letters = "ABCEHKMOPTXY";
+    long region = 1 + random_below(g, 199);
+
+    fprintf(f, "'%c%03ld%c%c%0*ld'", letters[random_below(g, 12)], random_below(g, 1000),
+        letters[random_below(g, 12)], letters[random_below(g, 12)], region < 100 ? 2 : 3, region);
+}
+
+// inspections of the last years, recent ones more often
+static Date random_date(Generator* g) {
+    Date d;
+    d.year = 2026 - (int)random_skewed(g, 12);
+    d.month = 1 + (int)random_below(g, 12);
+    d.day = 1 + (int)random_below(g, days_in_month(d.month, d.year));
+    return d;
+}
+
+static void put_date(FILE* f, Date d) {
+    fprintf(f, "'%02d.%02d.%d'", d.day, d.month, d.year);
+}
+
+static void put_status(FILE* f, Generator* g) {
+    fprintf(f, "'%s'", statuses[random_weighted(g, status_weights, 5)]);
+}
+
+static void put_insert(FILE* f, Generator* g) {
+    // a few units are inspected again under the same id
+    long id = random_below(g, 20) == 0 && g->next_id ? random_id(g) : g->next_id++;
+
+    fprintf(f, "insert unit_id=%ld, unit_model=\"%s\", car_id=", id, models[random_skewed(g, MODELS)]);
+    put_carnum(f, g);
+    fputs(", chk_date=", f);
+    put_date(f, random_date(g));
+    fputs(", status=", f);
+    put_status(f, g);
+    fputs(", mechanic=", f);
+    put_person(f, random_skewed(g, MECHANICS));
+    fputs(", driver=", f);
+    put_person(f, random_skewed(g, DRIVERS));
+    fputc('\n', f);
+}
+
+// conditions of a select, update or delete, most of them look up one unit
+static void put_conditions(FILE* f, Generator* g) {
+    long kind = random_below(g, 20);
+
+    if (kind < 12) {
+        fprintf(f, "unit_id==%ld", random_id(g));
+    } else if (kind < 15) {
+        // inspections of one week
+        Date d = random_date(g);
+        fputs("chk_date>=", f);
+        put_date(f, d);
+        d.day = d.day + 6 > days_in_month(d.month, d.year) ? days_in_month(d.month, d.year) : d.day + 6;
+        fputs(" chk_date<=", f);
+        put_date(f, d);
+    } else if (kind < 17) {
+        fputs("mechanic==", f);
+        put_person(f, random_skewed(g, MECHANICS));
+        fputs(" status/in/['broken','wearhigh']", f);
+    } else {
+        fputs("chk_date==", f);
+        put_date(f, random_date(g));
+    }
+}
+
+static void put_select(FILE* f, Generator* g) {
+    static const char* lists[] = {
+        "unit_id,status", "unit_id,car_id,chk_date", "unit_model,mechanic,driver",
+        "unit_id,unit_model,car_id,chk_date,status,mechanic,driver"
+    };
+
+    fprintf(f, "select %s ", lists[random_below(g, 4)]);
+    put_conditions(f, g);
+    fputc('\n', f);
+}
+
+static void put_update(FILE* f, Generator* g) {
+    switch (random_below(g, 3)) {
+        case 0:
+            fputs("update status=", f);
+            put_status(f, g);
+            break;
+        case 1:
+            fputs("update chk_date=", f);
+            put_date(f, random_date(g));
+            fputs(",status=", f);
+            put_status(f, g);
+            break;
+        default:
+            fputs("update driver=", f);
+            put_person(f, random_skewed(g, DRIVERS));
+            break;
+    }
+
+    fputc(' ', f);
+    put_conditions(f, g);
+    fputc('\n', f);
+}
+
+static void put_delete(FILE* f, Generator* g) {
+    if (random_below(g, 5) == 0) {
+        fputs("delete chk_date==", f);
+        put_date(f, random_date(g));
+    } else {
+        fprintf(f, "delete unit_id==%ld", random_id(g));
+    }
+
+    fputc('\n', f);
+}
+
+static void put_uniq(FILE* f, Generator* g) {
+    static const char* lists[] = { "unit_id", "unit_id,car_id", "car_id,mechanic" };
+    fprintf(f, "uniq %s\n", lists[random_below(g, 3)]);
+}
+
+static void put_sort(FILE* f, Generator* g) {
+    int keys = 1 + (int)random_below(g, 3);
+    int first = (int)random_below(g, 6);
+
+    // distinct fields, a repeated sort key is rejected
+    fputs("sort ", f);
+    for (int i = 0; i < keys; i++)
+        fprintf(f, "%s%s=%s", i ? "," : "", sort_fields[(first + i) % 6], random_below(g, 2) ? "asc" : "desc");
+    fputc('\n', f);
+}
+
+// writes the initial inserts and then the command mix to path
+static int generate_workload(const char* path, BenchOptions* opt) {
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return 0;
+
+    Generator g;
+    g.rng = opt->seed;
+    g.next_id = 0;
+
+    for (long i = 0; i < opt->rows; i++)
+        put_insert(f, &g);
+
+    for (long i = 0; i < opt->commands; i++) {
+        switch (random_weighted(&g, opt->mix, CMD_TYPES)) {
+            case 0: put_insert(f, &g); break;
+            case 1: put_select(f, &g); break;
+            case 2: put_update(f, &g); break;
+            case 3: put_delete(f, &g); break;
+            case 4: put_uniq(f, &g); break;
+            default: put_sort(f, &g); break;
+        }
+    }
+
+    return fclose(f) == 0;
+}
+
+static int command_type(const char* line) {
+    for (int i = 0; i < CMD_TYPES; i++) {
+        size_t n = strlen(cmd_names[i]);
+        if (strncmp(line, cmd_names[i], n) == 0 && line[n] == ' ')
+            return i;
+    }
+
+    return -1;
+}
+
+static int push_latency(Latencies* l, uint64_t ns) {
+    if (l->count == l->cap) {
+        long cap = l->cap ? l->cap * 2 : 1024;
+        uint64_t* tmp = (uint64_t*)realloc(l->ns, cap * sizeof(uint64_t));
+        if (!tmp)
+            return 0;
+
+        l->ns = tmp;
+        l->cap = cap;
+    }
+
+    l->ns[l->count++] = ns;
+    return 1;
+}
+
+// runs every line of the workload the way read_input does and times each command;
+// the indexing left over by an insert batch is charged to the command that ends the batch
+static int replay_workload(const char* input_path, const char* output_path, BenchOptions* opt,
+    Latencies* lat, uint64_t* total_ns) {
+    FILE* input = fopen(input_path, "r");
+    if (!input)
+        return 0;
+
+    Writer output;
+    if (!writer_open(&output, output_path, 0)) {
+        fclose(input);
+        return 0;
+    }
+
+    InputReader reader;
+    if (!input_open(&reader, input)) {
+        writer_close(&output);
+        fclose(input);
+        return 0;
+    }
+
+    struct Queue queue;
+    init_queue(&queue);
+    pool_start(&thread_pool, opt->threads);
+
+    InsertBatch batch;
+    memset(&batch, 0, sizeof(InsertBatch));
+
+    char* line = NULL;
+    size_t line_cap = 0;
+    const char* text;
+    size_t text_length;
+    int ok = 1;
+
+    uint64_t start = now_ns();
+
+    while (ok && (text = input_next_line(&reader, &text_length)) != NULL) {
+        if (text_length == 0)
+            continue;
+
+        if (text_length + 1 > line_cap) {
+            char* tmp = (char*)realloc(line, text_length + 1);
+            if (!tmp) {
+                ok = 0;
+                break;
+            }
+
+            line = tmp;
+            line_cap = text_length + 1;
+        }
+
+        memcpy(line, text, text_length);
+        line[text_length] = '\0';
+
+        int type = command_type(line);
+        uint64_t t = now_ns();
+
+        if (type == 0) {
+            bulk_insert(line, &output, &queue, &batch, NULL);
+        } else {
+            batch_end(&batch, &queue);
+            execute_command(line, &output, &queue);
+        }
+
+        if (type >= 0)
+            ok = push_latency(&lat[type], now_ns() - t);
+    }
+
+    batch_end(&batch, &queue);
+    writer_flush(&output);
+    *total_ns = now_ns() - start;
+
+    free_batch(&batch);
+    free(line);
+    pool_stop(&thread_pool);
+    free_plan_cache(&plan_cache);
+    free_db(&queue);
+    input_close(&reader);
+    fclose(input);
+
+    return writer_close(&output) && ok;
+}
+
+// runs an external lab_db build on the workload in dir and measures it as a whole process
+static int run_executable(BenchOptions* opt, uint64_t* total_ns, long* peak_rss_kb) {
+    char threads[32];
+    snprintf(threads, sizeof(threads), "%d", opt->threads);
+
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+
+    if (pid < 0)
+        return 0;
+
+    if (pid == 0) {
+        if (chdir(opt->dir) != 0)
+            _exit(127);
+
+        execl(opt->exe, opt->exe, "--threads", threads, (char*)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return 0;
+
+    *total_ns = now_ns() - start;
+    *peak_rss_kb = usage.ru_maxrss;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compare_ns(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of sorted latencies, in microseconds
+static double percentile_us(Latencies* l, int p) {
+    long rank = (l->count * p + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return l->ns[rank - 1] / 1000.0;
+}
+
+static void print_report(BenchOptions* opt, Latencies* lat, uint64_t replay_ns, long exe_rss_kb, uint64_t exe_ns) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    long total = opt->rows + opt->commands;
+
+    printf("{\"rows\":%ld,\"commands\":%ld,\"seed\":%llu,\"threads\":%d,\"mix\":{",
+        opt->rows, opt->commands, (unsigned long long)opt->seed, opt->threads);
+    for (int i = 0; i < CMD_TYPES; i++)
+        printf("%s\"%s\":%d", i ? "," : "", cmd_names[i], opt->mix[i]);
+
+    printf("},\"replay_ms\":%.3f,\"throughput_cmd_s\":%.1f,\"peak_rss_kb\":%ld,\"latency_us\":{",
+        replay_ns / 1e6, replay_ns ? total / (replay_ns / 1e9) : 0.0, usage.ru_maxrss);
+
+    int first = 1;
+    for (int i = 0; i < CMD_TYPES; i++) {
+        Latencies* l = &lat[i];
+        if (l->count == 0)
+            continue;
+
+        uint64_t sum = 0;
+        for (long j = 0; j < l->count; j++)
+            sum += l->ns[j];
+
+        qsort(l->ns, l->count, sizeof(uint64_t), compare_ns);
+
+        printf("%s\"%s\":{\"count\":%ld,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+            first ? "" : ",", cmd_names[i], l->count, sum / 1000.0 / l->count,
+            percentile_us(l, 50), percentile_us(l, 90), percentile_us(l, 99), l->ns[l->count - 1] / 1000.0);
+        first = 0;
+    }
+    printf("}");
+
+    if (opt->exe)
+        printf(",\"exe\":\"%s\",\"exe_ms\":%.3f,\"exe_throughput_cmd_s\":%.1f,\"exe_peak_rss_kb\":%ld",
+            opt->exe, exe_ns / 1e6, exe_ns ? total / (exe_ns / 1e9) : 0.0, exe_rss_kb);
+
+    printf("}\n");
+}
+
+// weights as insert=40,select=30,... ; commands that are not named get weight 0
+static int parse_mix(const char* str, int* mix) {
+    for (int i = 0; i < CMD_TYPES; i++)
+        mix[i] = 0;
+
+    while (*str) {
+        int type = -1;
+        size_t n = 0;
+
+        for (int i = 0; i < CMD_TYPES; i++) {
+            n = strlen(cmd_names[i]);
+            if (strncmp(str, cmd_names[i], n) == 0 && str[n] == '=') {
+                type = i;
+                break;
+            }
+        }
+
+        if (type == -1)
+            return 0;
+
+        char* end;
+        long w = strtol(str + n + 1, &end, 10);
+        if (end == str + n + 1 || w < 0 || w > 1000000)
+            return 0;
+
+        mix[type] = (int)w;
+        str = end;
+
+        if (*str == ',')
+            str++;
+        else if (*str != '\0')
+            return 0;
+    }
+
+    int total = 0;
+    for (int i = 0; i < CMD_TYPES; i++)
+        total += mix[i];
+
+    return total > 0;
+}
+
+static int parse_bench_options(int argc, char** argv, BenchOptions* opt) {
+    opt->rows = DEFAULT_ROWS;
+    opt->commands = DEFAULT_COMMANDS;
+    opt->seed = DEFAULT_SEED;
+    opt->threads = 1;
+    opt->exe = NULL;
+    opt->dir = ".";
+    memcpy(opt->mix, default_mix, sizeof(default_mix));
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc)
+            return 0;
+
+        const char* value = argv[++i];
+        char* end;
+
+        if (strcmp(argv[i - 1], "--rows") == 0) {
+            opt->rows = strtol(value, &end, 10);
+            if (*end != '\0' || opt->rows < 0)
+                return 0;
+        } else if (strcmp(argv[i - 1], "--commands") == 0) {
+            opt->commands = strtol(value, &end, 10);
+            if (*end != '\0' || opt->commands < 0)
+                return 0;
+        } else if (strcmp(argv[i - 1], "--seed") == 0) {
+            opt->seed = strtoull(value, &end, 10);
+            if (*end != '\0')
+                return 0;
+        } else if (strcmp(argv[i - 1], "--threads") == 0) {
+            opt->threads = (int)strtol(value, &end, 10);
+            if (*end != '\0' || opt->threads < 1)
+                return 0;
+        } else if (strcmp(argv[i - 1], "--mix") == 0) {
+            if (!parse_mix(value, opt->mix))
+                return 0;
+        } else if (strcmp(argv[i - 1], "--exe") == 0) {
+            opt->exe = value;
+        } else if (strcmp(argv[i - 1], "--dir") == 0) {
+            opt->dir = value;
+        } else {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opt;
+    if (!parse_bench_options(argc, argv, &opt)) {
+        fprintf(stderr, "usage: %s [--rows n] [--commands n] [--seed n] [--mix insert=w,select=w,update=w,delete=w,uniq=w,sort=w] [--threads n] [--exe lab_db] [--dir workdir]\n", argv[0]);
+        return 1;
+    }
+
+    char input_path[4096];
+    char output_path[4096];
+    snprintf(input_path, sizeof(input_path), "%s/input.txt", opt.dir);
+    snprintf(output_path, sizeof(output_path), "%s/bench_output.txt", opt.dir);
+
+    if (!generate_workload(input_path, &opt)) {
+        fprintf(stderr, "cannot write %s\n", input_path);
+        return 1;
+    }
+
+    uint64_t exe_ns = 0;
+    long exe_rss_kb = 0;
+
+    if (opt.exe && !run_executable(&opt, &exe_ns, &exe_rss_kb)) {
+        fprintf(stderr, "%s failed on %s\n", opt.exe, input_path);
+        return 1;
+    }
+
+    Latencies lat[CMD_TYPES];
+    memset(lat, 0, sizeof(lat));
+    uint64_t replay_ns = 0;
+
+    if (!replay_workload(input_path, output_path, &opt, lat, &replay_ns)) {
+        fprintf(stderr, "cannot replay %s\n", input_path);
+        return 1;
+    }
+
+    print_report(&opt, lat, replay_ns, exe_rss_kb, exe_ns);
+
+    for (int i = 0; i < CMD_TYPES; i++)
+        free(lat[i].ns);
+
+    return 0;
+}
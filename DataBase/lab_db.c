@@ -2,19 +2,228 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define FIELD_COUNT 7
 #define MAX_STATUS 5
 #define INITIAL_BUFFER_SIZE 256
 #define BUFFER_GROWTH_FACTOR 2
+#define MAX_STRING_LEN 256
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 4
+#define ARENA_CLASSES ((MAX_STRING_LEN + 2 * ARENA_ALIGN - 1) / ARENA_ALIGN + 1)
+#define SLAB_RECORDS 4096
+#define BTREE_ORDER 64
+#define INDEX_SCAN_FRACTION 4
+#define STATUS_SCAN_FRACTION 2
+#define INDEXED_FIELDS ((1 << 0) | (1 << 3) | (1 << 4))
+#define STATUS_ARRAY_MAX 4096
+#define STATUS_CHUNK_WORDS 1024
+#define PARALLEL_MIN_ROWS 16384
+#define TASKS_PER_THREAD 4
+#define RADIX_CUTOFF 32
+#define PARALLEL_SORT_ROWS 65536
+#define SNAPSHOT_MAGIC "LABDBSNP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define WAL_MAGIC "LABDBWAL"
+#define WAL_VERSION 1
+#define WAL_DEFAULT_GROUP 1024
+#define WRITER_BUFFER_SIZE (1 << 20)
+#define PLAN_CACHE_BUCKETS 256
+#define PLAN_CACHE_LIMIT 1024
+#define STATS_TYPES 8
+#define STATS_SLOWEST 10
+#define STATS_TEXT_LEN 40
+#define ALLOC_SITES 256
+#define SERVER_CLIENTS 64
+#define CLIENT_BUFFER_SIZE 65536
+#define CLIENT_OUTPUT_LIMIT (4 * WRITER_BUFFER_SIZE)
+#define SERVER_DRAIN_MS 1000
+#define VERSION_LIVE UINT64_MAX
+#define PIPELINE_SLOTS 256
+#define OUTPUT_BUFFERS 4
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
 
 int cnt_malloc = 0;
 int cnt_realloc = 0;
 int cnt_free = 0;
 int cnt_strdup = 0;
 
+// header in front of every tracked block, keeps its size for db_realloc and db_free
+typedef union {
+    size_t size;
+    max_align_t align;
+} AllocHeader;
+
+// allocations made by one line of this file
+typedef struct {
+    const char* func;
+    int line;
+    long count;
+    uint64_t bytes;
+} AllocSite;
+
+// bytes asked for by all allocations, bytes in use now and the most that were in use at once
+uint64_t bytes_requested = 0;
+uint64_t live_bytes = 0;
+uint64_t peak_bytes = 0;
+
+AllocSite alloc_sites[ALLOC_SITES];
+
+// reader threads allocate too, the counters above are only changed under this lock
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// every allocation goes through these, so memstat.txt can count it at its call site
+#define db_malloc(size) tracked_malloc((size), __func__, __LINE__)
+#define db_realloc(ptr, size) tracked_realloc((ptr), (size), __func__, __LINE__)
+#define db_strdup(s) tracked_strdup((s), __func__, __LINE__)
+#define db_free(ptr) tracked_free(ptr)
+
+// called with alloc_lock held
+void note_alloc(const char* func, int line, size_t size) {
+    bytes_requested += size;
+    live_bytes += size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+
+    // the line alone tells the call sites apart, a full table only loses the per-site numbers
+    unsigned int i = (unsigned int)line % ALLOC_SITES;
+    for (int probe = 0; probe < ALLOC_SITES; probe++, i = (i + 1) % ALLOC_SITES) {
+        AllocSite* site = &alloc_sites[i];
+
+        if (site->line == 0) {
+            site->func = func;
+            site->line = line;
+        }
+
+        if (site->line == line) {
+            site->count++;
+            site->bytes += size;
+            return;
+        }
+    }
+}
+
+void* tracked_block(size_t size) {
+    AllocHeader* h = (AllocHeader*)malloc(sizeof(AllocHeader) + size);
+    if (!h)
+        return NULL;
+
+    h->size = size;
+    return h + 1;
+}
+
+void* tracked_malloc(size_t size, const char* func, int line) {
+    void* p = tracked_block(size);
+    if (!p)
+        return NULL;
+
+    pthread_mutex_lock(&alloc_lock);
+    cnt_malloc++;
+    note_alloc(func, line, size);
+    pthread_mutex_unlock(&alloc_lock);
+    return p;
+}
+
+// a realloc of NULL is counted as a malloc
+void* tracked_realloc(void* ptr, size_t size, const char* func, int line) {
+    if (!ptr)
+        return tracked_malloc(size, func, line);
+
+    AllocHeader* old = (AllocHeader*)ptr - 1;
+    size_t old_size = old->size;
+
+    AllocHeader* h = (AllocHeader*)realloc(old, sizeof(AllocHeader) + size);
+    if (!h)
+        return NULL;
+
+    h->size = size;
+
+    pthread_mutex_lock(&alloc_lock);
+    cnt_realloc++;
+    live_bytes -= old_size;
+    note_alloc(func, line, size);
+    pthread_mutex_unlock(&alloc_lock);
+    return h + 1;
+}
+
+char* tracked_strdup(const char* s, const char* func, int line) {
+    size_t len = strlen(s) + 1;
+
+    char* p = (char*)tracked_block(len);
+    if (!p)
+        return NULL;
+
+    pthread_mutex_lock(&alloc_lock);
+    cnt_strdup++;
+    note_alloc(func, line, len);
+    pthread_mutex_unlock(&alloc_lock);
+
+    memcpy(p, s, len);
+    return p;
+}
+
+// free of NULL does nothing and is not counted
+void tracked_free(void* ptr) {
+    if (!ptr)
+        return;
+
+    AllocHeader* h = (AllocHeader*)ptr - 1;
+
+    pthread_mutex_lock(&alloc_lock);
+    live_bytes -= h->size;
+    cnt_free++;
+    pthread_mutex_unlock(&alloc_lock);
+
+    free(h);
+}
+
+int compare_sites(const void* a, const void* b) {
+    const AllocSite* x = (const AllocSite*)a;
+    const AllocSite* y = (const AllocSite*)b;
+
+    if (x->bytes != y->bytes)
+        return x->bytes < y->bytes ? 1 : -1;
+    return x->line - y->line;
+}
+
+// the byte totals and the call sites, most bytes first
+void write_alloc_stats(FILE* f) {
+    fprintf(f, "bytes_requested:%llu\n", (unsigned long long)bytes_requested);
+    fprintf(f, "live_bytes:%llu\n", (unsigned long long)live_bytes);
+    fprintf(f, "peak_bytes:%llu\n", (unsigned long long)peak_bytes);
+
+    AllocSite sites[ALLOC_SITES];
+    int count = 0;
+
+    for (int i = 0; i < ALLOC_SITES; i++)
+        if (alloc_sites[i].line != 0)
+            sites[count++] = alloc_sites[i];
+
+    qsort(sites, count, sizeof(AllocSite), compare_sites);
+
+    for (int i = 0; i < count; i++)
+        fprintf(f, "site:%s:%d count:%ld bytes:%llu\n", sites[i].func, sites[i].line,
+            sites[i].count, (unsigned long long)sites[i].bytes);
+}
+
 //enum for a status
 typedef enum {
     well,
@@ -37,24 +246,196 @@ typedef struct {
     int year;
 } Date;
 
-// the basic structure of the database
+// the basic structure of the database, rid grows along the queue order, car_key is the packed carnum,
+// strings live in the string arena of the queue; a row version is seen by the snapshots taken at an
+// lsn in [begin, end), older is the version it replaced
 typedef struct Node {
     int unit_id;
-    char unit_model[256];
-    char carnum[256];
     Date chk_date;
     Status status;
-    char mechanic[256];
-    char driver[256];
+    unsigned int rid;
+    const char* unit_model;
+    const char* carnum;
+    const char* mechanic;
+    const char* driver;
+    uint64_t car_key;
+    uint64_t begin;
+    uint64_t end;
+    struct Node* older;
     struct Node* next;
+    struct Node* prev;
 } Node;
 
+// block of the string arena, strings are appended one after another, each in a slot that starts
+// with the number of records pointing to it
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+// the arena also owns the mapped snapshot whose strings the loaded rows point to;
+// a slot whose string lost its last record goes to the free list of its size
+typedef struct {
+    ArenaBlock* head;
+    size_t bytes;
+    char* free_slots[ARENA_CLASSES];
+    size_t free_bytes;
+    void* mapped;
+    size_t mapped_size;
+} StringArena;
+
+// slab of records handed out by the node pool
+typedef struct Slab {
+    struct Slab* next;
+    Node records[SLAB_RECORDS];
+} Slab;
+
+// pool of records, deleted records are reused through the free list
+typedef struct {
+    Slab* slabs;
+    int slab_count;
+    int slab_used;
+    Node* free_list;
+    int free_count;
+    int live;
+} NodePool;
+
+// entry of a posting list, a dead entry keeps its rid so the list stays ordered
+typedef struct {
+    unsigned int rid;
+    Node* node;
+} IdEntry;
+
+// rows with the same unit_id ordered by rid
+typedef struct {
+    int key;
+    int used;
+    int count;
+    int dead;
+    int cap;
+    IdEntry* entries;
+} IdPosting;
+
+// hash index on unit_id, a broken index is not used or maintained until it is rebuilt
+typedef struct {
+    IdPosting* slots;
+    size_t size;
+    size_t keys;
+    int broken;
+} IdIndex;
+
+// key of the chk_date index, the rid makes every key unique
+typedef struct {
+    int date;
+    unsigned int rid;
+} DateKey;
+
+// node of the B+-tree on chk_date, leaves are chained in key order
+typedef struct BTreeNode {
+    int leaf;
+    int count;
+    DateKey keys[BTREE_ORDER];
+    union {
+        struct BTreeNode* children[BTREE_ORDER + 1];
+        Node* rows[BTREE_ORDER];
+    } ptr;
+    struct BTreeNode* next;
+} BTreeNode;
+
+// ordered index on chk_date, deletes don't rebalance the tree, a broken index waits for a rebuild
+typedef struct {
+    BTreeNode* root;
+    int broken;
+} DateIndex;
+
+// rids of one status among one run of 65536 rids, as their low 16 bits: a sorted array
+// while there are at most STATUS_ARRAY_MAX of them, a bitmap otherwise
+typedef struct {
+    uint16_t* values;
+    uint64_t* bits;
+    int count;
+    int cap;
+} StatusChunk;
+
+// compressed bitmaps of the rids of each status, chunks[chunk * MAX_STATUS + status]
+typedef struct {
+    StatusChunk* chunks;
+    unsigned int chunk_cap;
+    int counts[MAX_STATUS];
+    int broken;
+} StatusIndex;
+
+// row versions and directories the open snapshots may still read, kept in the order they were retired
+enum { RETIRED_ROW, RETIRED_VERSION, RETIRED_DIRECTORY };
+
+typedef struct {
+    void* ptr;
+    uint64_t lsn;
+    int kind;
+} Retired;
+
+// while snapshots are open writers copy a row before changing it and leave deleted rows in the
+// rid directory; what they replace is freed once the oldest snapshot is past the lsn it was retired at
+typedef struct {
+    Retired* items;
+    size_t head;
+    size_t count;
+    size_t cap;
+    int snapshots;
+    uint64_t oldest;
+    long versions;
+} Versions;
+
+// lsn counts the commands that changed the table, it ties snapshots to the write-ahead log,
+// rows maps a rid to its row (NULL once the row is deleted) so the table can be split into ranges
 typedef struct Queue {
     struct Node* head;
     struct Node* tail;
     int size;
+    unsigned int next_rid;
+    Node** rows;
+    unsigned int rows_cap;
+    unsigned int holes;
+    uint64_t lsn;
+    StringArena strings;
+    NodePool pool;
+    IdIndex id_index;
+    DateIndex date_index;
+    StatusIndex status_index;
+    Versions versions;
 } Queue;
 
+// rows of the rid directory below count as they were at lsn, taken between two commands
+typedef struct {
+    Node** rows;
+    unsigned int count;
+    uint64_t lsn;
+} Snapshot;
+
+// rows picked by an index or a scan, in queue order
+typedef struct {
+    Node** rows;
+    int count;
+} RowSet;
+
+// worker threads that run the tasks of one job at a time, the calling thread takes tasks too
+typedef struct {
+    pthread_t* threads;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    void (*run)(void* job, int task);
+    void* job;
+    int tasks;
+    int next;
+    int finished;
+    unsigned long round;
+    int stop;
+} ThreadPool;
+
 typedef enum {
     OP_EQ,
     OP_NE,
@@ -66,14 +447,20 @@ typedef enum {
     OP_NOT_IN
 } Operator;
 
-typedef struct {
+typedef struct Condition Condition;
+
+// evaluator of one condition, specialized for its field and operator
+typedef int (*CondFn)(const Node* n, const Condition* c);
+
+struct Condition {
     int field;
     Operator op;
+    CondFn eval;
 
     union {
         int i;
-        char str[256];
-        char carnum[256];
+        const char* str;
+        const char* carnum;
         Date date;
         struct {
             Status list[MAX_STATUS];
@@ -81,17 +468,25 @@ typedef struct {
         } status;
     } value;
 
-} Condition;
+    // the value decoded once for the evaluator
+    union {
+        int i;
+        uint64_t key;
+        unsigned int mask;
+    } arg;
+
+};
 
 typedef struct {
     int field;
     union {
         int i;
-        char str[256];
-        char carnum[256];
+        const char* str;
+        const char* carnum;
         Date date;
         Status status;
     } value;
+    uint64_t car_key;
 } Update;
 
 typedef struct {
@@ -99,6 +494,398 @@ typedef struct {
     OrderType order;
 } SortKey;
 
+// order by and limit of a select, key_count is 0 without order by and limit -1 without limit
+typedef struct {
+    SortKey* keys;
+    int key_count;
+    int limit;
+} SelectOrder;
+
+// matching row with its place among the matches, which breaks ties between equal keys
+typedef struct {
+    Node* row;
+    unsigned int seq;
+} TopEntry;
+
+// rows kept for a select with order by or limit: without order by the first limit matches,
+// with it a heap of at most limit rows whose root is the row that would be printed last
+typedef struct {
+    const SelectOrder* order;
+    TopEntry* items;
+    int count;
+    int cap;
+    unsigned int seen;
+} TopRows;
+
+// row with its sort keys encoded into one byte string, see encode_sort_key,
+// prefix caches the 8 key bytes the radix sort is working on
+typedef struct {
+    uint64_t prefix;
+    const unsigned char* key;
+    size_t len;
+    Node* row;
+} SortEntry;
+
+// job of a sort, the entries are split into runs that are encoded and sorted one per task,
+// then pairs of sorted runs are merged from src into dst, each merge split into pieces
+typedef struct {
+    SortKey* keys;
+    int key_count;
+    SortEntry* src;
+    SortEntry* dst;
+    int count;
+    int runs;
+    int width;
+    int pieces;
+    size_t* offsets;
+    unsigned char* buf;
+} SortJob;
+
+// header of a snapshot file, followed by count records and the string block
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t record_size;
+    int32_t queue_size;
+    uint64_t lsn;
+    uint64_t count;
+    uint64_t strings_size;
+} SnapshotHeader;
+
+// record of a snapshot file, strings are offsets into the string block
+typedef struct {
+    int32_t unit_id;
+    int32_t chk_date;
+    int32_t status;
+    uint32_t unit_model;
+    uint64_t car_key;
+    uint32_t carnum;
+    uint32_t mechanic;
+    uint32_t driver;
+    uint32_t reserved;
+} SnapshotRecord;
+
+// header at the start of a write-ahead log file
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+} WalHeader;
+
+// header of a logged command, the command text follows it
+typedef struct {
+    uint64_t lsn;
+    uint32_t length;
+    uint32_t checksum;
+} WalRecord;
+
+// write-ahead log, records wait in buf until a group of them is written with one fsync
+typedef struct {
+    int fd;
+    char* buf;
+    size_t len;
+    size_t cap;
+    int pending;
+    int group;
+    long records;
+    uint64_t bytes;
+    long syncs;
+    uint64_t time_ns;
+} Wal;
+
+// totals of one command type, collected with --stats
+typedef struct {
+    long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t scanned;
+    uint64_t matched;
+    uint64_t modified;
+} CommandStats;
+
+// one of the slowest commands of input.txt with its line number and the start of its text
+typedef struct {
+    uint64_t ns;
+    long line;
+    char text[STATS_TEXT_LEN + 1];
+} SlowCommand;
+
+// per command type totals and the slowest commands, slowest first
+typedef struct {
+    CommandStats types[STATS_TYPES];
+    SlowCommand slowest[STATS_SLOWEST];
+    int slow_count;
+} Stats;
+
+// buffer of results on its way to the output thread
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} OutputBuffer;
+
+// thread that writes the buffers a writer filled while the commands fill the next one,
+// full is a queue that starts at head, spare holds the buffers it wrote
+typedef struct OutputStage {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    int stop;
+    int failed;
+    OutputBuffer full[OUTPUT_BUFFERS];
+    int head;
+    int full_count;
+    OutputBuffer spare[OUTPUT_BUFFERS];
+    int spare_count;
+} OutputStage;
+
+// output of the commands: results are formatted into buf and written with write,
+// a mapped writer formats them straight into a shared mapping of the output file that grows
+// as needed, and a writer without a file (fd -1) drops them; with a stage a full buffer is
+// handed to the output thread instead of being written here; a holding writer grows its buffer
+// instead, so nothing is written before the caller flushes it (after the log group is durable).
+// The writer of a socket client sends the bytes from sent up to ready without blocking
+typedef struct {
+    int fd;
+    int mapped;
+    int hold;
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t sent;
+    size_t ready;
+    int failed;
+    OutputStage* stage;
+} Writer;
+
+// input file, mapped or read whole, that is handed out one line at a time
+typedef struct {
+    char* data;
+    size_t size;
+    size_t pos;
+    int mapped;
+} InputReader;
+
+// run of consecutive inserts, the new rows are indexed when the run ends
+typedef struct {
+    char* scratch;
+    size_t scratch_cap;
+    unsigned int first_rid;
+    int rows;
+} InsertBatch;
+
+// runs command lines against one queue: consecutive inserts form a batch, changes are logged,
+// results go to output, which the server points at the client that sent the line
+typedef struct {
+    Queue* queue;
+    Writer* output;
+    Wal* wal;
+    Stats* stats;
+    InsertBatch batch;
+    char* line;
+    size_t line_cap;
+    long line_number;
+} Runner;
+
+struct ReadJob;
+
+// connection of the server, lines from pos on are not run yet; while a reader thread runs
+// the client's select, job is set and the lines after it wait
+typedef struct {
+    int fd;
+    char* buf;
+    size_t pos;
+    size_t len;
+    size_t cap;
+    int eof;
+    int done;
+    struct ReadJob* job;
+    Writer out;
+} Client;
+
+// select run by a reader thread on a snapshot, the timings go to the stats when it is collected
+typedef struct ReadJob {
+    Client* client;
+    Snapshot snapshot;
+    long line_number;
+    uint64_t ns;
+    uint64_t scanned;
+    uint64_t matched;
+    struct ReadJob* next;
+    size_t len;
+    char line[];
+} ReadJob;
+
+// threads that run selects next to the server thread, a finished job is put on done and
+// a byte on the pipe wakes the server's poll
+typedef struct {
+    pthread_t* threads;
+    int count;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    ReadJob* pending;
+    ReadJob* pending_tail;
+    ReadJob* done;
+    int pipe[2];
+    long reads;
+} ReaderPool;
+
+// line taken apart by the parse thread of --pipeline: text is the line in the input, for the log
+// and the stats, work is the copy the parser cut apart (left whole for the commands it does not
+// parse) and row holds an insert, its strings in a second copy after work; type is 'i', 's', 'd'
+// or 'u' for a parsed command and 0 otherwise, parsed tells if the parser accepted it
+typedef struct {
+    const char* text;
+    char* work;
+    size_t len;
+    size_t cap;
+    long line_number;
+    char type;
+    int parsed;
+    Node row;
+    int* fields;
+    int field_count;
+    Condition* conds;
+    int cond_count;
+    Update* upds;
+    int upd_count;
+    SelectOrder order;
+} Command;
+
+// bounded ring from the parse thread to the executor: each side only moves its own index and
+// reads the other one, a side that finds the ring empty or full sleeps until the other one
+// moves; closed is set after the last line, stop asks the parser to give up
+typedef struct {
+    Command* slots;
+    size_t head;
+    size_t tail;
+    int closed;
+    int stop;
+    int sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    InputReader* input;
+} CommandRing;
+
+// command line options
+typedef struct {
+    const char* load_path;
+    const char* save_path;
+    const char* wal_path;
+    int wal_group;
+    int threads;
+    int sort_threshold;
+    int mmap_output;
+    const char* stats_path;
+    const char* socket_path;
+    int stdio;
+    int readers;
+    int pipeline;
+} Options;
+
+// count, min(field) or max(field) of an aggregate: kind is 'c', '<' for min or '>' for max
+typedef struct {
+    char kind;
+    int field;
+} AggregateItem;
+
+// groups of an aggregate in order of their first row: keys[g] is that row, extremes holds the row
+// with the min or max of each item per group; the groups of a status are found through
+// status_groups, other groups through an open addressing table of group numbers + 1
+typedef struct {
+    AggregateItem* items;
+    int item_count;
+    int group_field;
+    Node** keys;
+    uint64_t* hashes;
+    int* counts;
+    Node** extremes;
+    int group_count;
+    int group_cap;
+    int status_groups[MAX_STATUS];
+    int* table;
+    size_t table_size;
+} Aggregate;
+
+// slot of the hash table used by uniq
+typedef struct {
+    Node* node;
+    uint64_t hash;
+    int count;
+} UniqSlot;
+
+// job of a parallel scan, task i checks the rids [i * chunk, (i + 1) * chunk)
+typedef struct {
+    Queue* q;
+    Condition* conds;
+    int count;
+    unsigned int chunk;
+    unsigned char* hits;
+    int* found;
+} ScanJob;
+
+// parsed select, delete or update, shared by all commands of the same shape;
+// only the literals are parsed again when it is reused
+typedef struct Plan {
+    struct Plan* next;
+    uint64_t hash;
+    char* key;
+    size_t key_len;
+    char command;
+    int* fields;
+    int field_count;
+    Update* upds;
+    int upd_count;
+    Condition* conds;
+    int cond_count;
+} Plan;
+
+// field name of a lexed command with the operator and the literal that follow it,
+// offsets are into the command line, lit is -1 for a select field
+typedef struct {
+    int name;
+    int name_len;
+    Operator op;
+    int lit;
+    int lit_len;
+} PlanItem;
+
+// plans keyed on the command with its literals replaced by '?'
+typedef struct {
+    Plan* buckets[PLAN_CACHE_BUCKETS];
+    int count;
+    PlanItem* items;
+    int item_count;
+    int item_cap;
+    int head;
+    char* key;
+    char* bind;
+    size_t buf_cap;
+    long hits;
+    long misses;
+} PlanCache;
+
+// workers of the parallel scan and sort, none unless --threads asks for them
+ThreadPool thread_pool;
+
+// threads of the server that run selects on snapshots, none unless --readers asks for them
+ReaderPool reader_pool;
+
+// plans of the commands run so far
+PlanCache plan_cache;
+
+// smallest table sorted in parallel, set by --sort-threshold
+int parallel_sort_rows = PARALLEL_SORT_ROWS;
+
+// rows checked against conditions and rows that matched, added to once per command
+uint64_t rows_scanned = 0;
+uint64_t rows_matched = 0;
+
+// command types of the stats, incorrect is any line no handler accepts
+const char* stats_names[STATS_TYPES] = { "insert", "select", "delete", "update", "uniq", "sort", "aggregate", "incorrect" };
 
 // array with the names of the arguments
 const char* field_names[FIELD_COUNT] = {
@@ -116,1390 +903,6320 @@ void init_queue(struct Queue* queue) {
     queue->head = NULL;
     queue->tail = NULL;
     queue->size = 0;
+    queue->next_rid = 0;
+    queue->rows = NULL;
+    queue->rows_cap = 0;
+    queue->holes = 0;
+    queue->lsn = 0;
+    queue->strings.head = NULL;
+    queue->strings.bytes = 0;
+    memset(queue->strings.free_slots, 0, sizeof(queue->strings.free_slots));
+    queue->strings.free_bytes = 0;
+    queue->strings.mapped = NULL;
+    queue->strings.mapped_size = 0;
+    memset(&queue->pool, 0, sizeof(NodePool));
+    memset(&queue->id_index, 0, sizeof(IdIndex));
+    memset(&queue->date_index, 0, sizeof(DateIndex));
+    memset(&queue->status_index, 0, sizeof(StatusIndex));
+    memset(&queue->versions, 0, sizeof(Versions));
 }
 
-// function of removing spaces
-char* trim(char* s)
-{
-    while (*s == ' ')
-        s++;
+// takes a record from the free list or from the newest slab
+Node* alloc_node(NodePool* pool) {
+    Node* n = pool->free_list;
 
-    char* end = s + strlen(s) - 1;
+    if (n) {
+        pool->free_list = n->next;
+        pool->free_count--;
+        pool->live++;
+        return n;
+    }
 
-    while (end > s && *end == ' ') {
-        *end = '\0';
-        end--;
+    if (!pool->slabs || pool->slab_used == SLAB_RECORDS) {
+        Slab* slab = (Slab*)db_malloc(sizeof(Slab));
+        if (!slab)
+            return NULL;
+
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_count++;
+        pool->slab_used = 0;
     }
 
-    return s;
+    pool->live++;
+    return &pool->slabs->records[pool->slab_used++];
 }
 
-// function of parsing int
-int parse_int(const char* s, int* out) {
-    char* end;
-    long val = strtol(s, &end, 10);
+// returns a record to the free list
+void release_node(NodePool* pool, Node* n) {
+    if (!n)
+        return;
 
-    if (*s == '\0' || *end != '\0')
-        return 0;
-    
-    if (val <= INT_MAX && val >= INT_MIN) {
-        *out = (int)val;
-        return 1;
-    }
-    return 0;
+    n->next = pool->free_list;
+    pool->free_list = n;
+    pool->free_count++;
+    pool->live--;
 }
 
-// function of parsing string with double quotes
-int parse_double_quoted_string(char* value, char* dest, size_t max)
-{
-    size_t len = strlen(value);
-
-    if (len < 2)
-        return 0;
+// releases all slabs at once
+void free_pool(NodePool* pool) {
+    Slab* slab = pool->slabs;
 
-    if (value[0] != '"' || value[len - 1] != '"')
-        return 0;
+    while (slab) {
+        Slab* next = slab->next;
+        db_free(slab);
+        slab = next;
+    }
 
-    value[len - 1] = '\0';
-    value++;
+    memset(pool, 0, sizeof(NodePool));
+}
 
-    if (strlen(value) >= max)
-        return 0;
+// bytes of the slot that holds a string of len characters, its terminator and its reference count
+size_t arena_slot_size(size_t len) {
+    return (sizeof(uint32_t) + len + 1 + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
 
-    strcpy(dest, value);
+// copies a string into the arena with one reference, a free slot of the same size is reused first
+const char* arena_strdup(StringArena* arena, const char* s) {
+    size_t len = strlen(s);
+    size_t size = arena_slot_size(len);
+    size_t class_index = size / ARENA_ALIGN;
+    char* slot;
+
+    if (class_index < ARENA_CLASSES && arena->free_slots[class_index]) {
+        slot = arena->free_slots[class_index];
+        memcpy(&arena->free_slots[class_index], slot, sizeof(char*));
+        arena->free_bytes -= size;
+    } else {
+        ArenaBlock* block = arena->head;
 
-    return 1;
-}
+        if (!block || block->size - block->used < size) {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
 
-// letter verification function for carnum
-int valid_letter(char c) {
-    const char* allowed = "ABCEHKMOPTXY";
-    return strchr(allowed, c) != NULL;
-}
+            block = (ArenaBlock*)db_malloc(sizeof(ArenaBlock) + block_size);
+            if (!block)
+                return NULL;
 
-// function of parsing carnum
-int parse_carnum(char* value, char* dest, size_t max) {
-    size_t len = strlen(value);
+            block->next = arena->head;
+            block->used = 0;
+            block->size = block_size;
+            arena->head = block;
+            arena->bytes += block_size;
+        }
 
-    if (len < 2 || value[0] != '\'' || value[len - 1] != '\'')
-        return 0;
+        slot = block->data + block->used;
+        block->used += size;
+    }
 
-    value[len - 1] = '\0';
-    value++;
+    *(uint32_t*)slot = 1;
+    memcpy(slot + sizeof(uint32_t), s, len + 1);
 
-    len = strlen(value);
+    return slot + sizeof(uint32_t);
+}
 
-    if (len != 8 && len != 9)
-        return 0;
+// the strings of a loaded snapshot stay in its mapping and are not counted
+int arena_counted(const StringArena* arena, const char* s) {
+    const char* mapped = (const char*)arena->mapped;
+    return s && !(mapped && s >= mapped && s < mapped + arena->mapped_size);
+}
 
-    if (!valid_letter(value[0]))
-        return 0;
+void arena_hold(StringArena* arena, const char* s) {
+    if (arena_counted(arena, s))
+        (*(uint32_t*)(s - sizeof(uint32_t)))++;
+}
 
-    for (int i = 1; i <= 3; i++)
-        if (!isdigit(value[i]))
-            return 0;
+// drops a reference, the slot of a string without references is reused by a later copy
+void arena_release(StringArena* arena, const char* s) {
+    if (!arena_counted(arena, s))
+        return;
 
-    if (!valid_letter(value[4]) || !valid_letter(value[5]))
-        return 0;
+    char* slot = (char*)s - sizeof(uint32_t);
+    if (--*(uint32_t*)slot > 0)
+        return;
 
-    for (int i = 6; i < (int)len; i++)
-        if (!isdigit(value[i]))
-            return 0;
+    size_t size = arena_slot_size(strlen(s));
+    size_t class_index = size / ARENA_ALIGN;
 
-    if (len >= max)
-        return 0;
+    // longer strings than the parsers accept would only be freed with the arena
+    if (class_index >= ARENA_CLASSES)
+        return;
 
-    strcpy(dest, value);
+    memcpy(slot, &arena->free_slots[class_index], sizeof(char*));
+    arena->free_slots[class_index] = slot;
+    arena->free_bytes += size;
+}
 
-    return 1;
+// a record holds one reference to each of its strings
+void hold_row_strings(StringArena* arena, const Node* n) {
+    arena_hold(arena, n->unit_model);
+    arena_hold(arena, n->carnum);
+    arena_hold(arena, n->mechanic);
+    arena_hold(arena, n->driver);
 }
 
-// cheaking leap year
-int is_leap(int y) {
-    return (y % 4 == 0 && y % 100 != 0) || (y % 400 == 0);
+void release_row_strings(StringArena* arena, const Node* n) {
+    arena_release(arena, n->unit_model);
+    arena_release(arena, n->carnum);
+    arena_release(arena, n->mechanic);
+    arena_release(arena, n->driver);
 }
 
-// checking day
-int days_in_month(int m, int y) {
-    static int d[] = {
-        31,28,31,30,31,30,
-        31,31,30,31,30,31
-    };
+void free_arena(StringArena* arena) {
+    ArenaBlock* block = arena->head;
 
-    if (m == 2 && is_leap(y))
-        return 29;
+    while (block) {
+        ArenaBlock* next = block->next;
+        db_free(block);
+        block = next;
+    }
 
-    return d[m - 1];
-}
+    if (arena->mapped)
+        munmap(arena->mapped, arena->mapped_size);
 
-// function of parsing date
-int parse_date(char* value, Date* out) {
-    size_t len = strlen(value);
+    arena->head = NULL;
+    arena->bytes = 0;
+    memset(arena->free_slots, 0, sizeof(arena->free_slots));
+    arena->free_bytes = 0;
+    arena->mapped = NULL;
+    arena->mapped_size = 0;
+}
 
-    if (len < 8)
-        return 0;
+// buffered writer to an open file, pipe or socket, the writer owns fd once this succeeded
+int writer_attach(Writer* w, int fd) {
+    memset(w, 0, sizeof(Writer));
+    w->fd = fd;
 
-    if (value[0] != '\'' || value[len - 1] != '\'')
+    w->buf = (char*)db_malloc(WRITER_BUFFER_SIZE);
+    if (!w->buf) {
+        w->fd = -1;
         return 0;
+    }
+    w->cap = WRITER_BUFFER_SIZE;
 
-    value[len - 1] = '\0';
-    value++;
+    return 1;
+}
 
-    int d, m, y;
+// opens the output file, a mapped writer maps it instead of buffering
+int writer_open(Writer* w, const char* path, int mapped) {
+    int fd = open(path, (mapped ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
 
-    if (sscanf(value, "%d.%d.%d", &d, &m, &y) != 3)
+    if (fd < 0) {
+        memset(w, 0, sizeof(Writer));
+        w->fd = -1;
         return 0;
+    }
 
-    if (y < 1000 || y > 2026)
-        return 0;
+    if (!mapped) {
+        if (writer_attach(w, fd))
+            return 1;
 
-    if (m < 1 || m > 12)
+        close(fd);
         return 0;
+    }
 
-    int maxd = days_in_month(m, y);
+    memset(w, 0, sizeof(Writer));
+    w->mapped = 1;
+    w->fd = fd;
+    return 1;
+}
 
-    if (d < 1 || d > maxd)
-        return 0;
+// writer that drops everything, used when the write-ahead log is replayed
+void writer_sink(Writer* w) {
+    memset(w, 0, sizeof(Writer));
+    w->fd = -1;
+}
 
-    out->day = d;
-    out->month = m;
-    out->year = y;
+int write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return 0;
+
+        data += n;
+        size -= (size_t)n;
+    }
 
     return 1;
 }
 
-// function of parsing status
-int parse_status(char* value, Status* out) {
-    size_t len = strlen(value);
+// writes the full buffers handed over by the executor until the stage is stopped
+void* output_thread(void* arg) {
+    OutputStage* s = (OutputStage*)arg;
 
-    if (len < 2)
-        return 0;
+    pthread_mutex_lock(&s->lock);
 
-    if (value[0] != '\'' || value[len - 1] != '\'')
-        return 0;
+    for (;;) {
+        while (!s->stop && s->full_count == 0)
+            pthread_cond_wait(&s->cond, &s->lock);
 
-    value[len - 1] = '\0';
-    value++;
+        // the buffers handed over before the stop are written first
+        if (s->full_count == 0)
+            break;
 
-    if (strcmp(value, "well") == 0)
-        *out = well;
-    else if (strcmp(value, "wearlow") == 0)
-        *out = wearlow;
-    else if (strcmp(value, "wearhigh") == 0)
-        *out = wearhigh;
-    else if (strcmp(value, "broken") == 0)
-        *out = broken;
-    else if (strcmp(value, "notcheck") == 0)
-        *out = notcheck;
-    else
+        OutputBuffer b = s->full[s->head];
+        s->head = (s->head + 1) % OUTPUT_BUFFERS;
+        s->full_count--;
+
+        pthread_mutex_unlock(&s->lock);
+        int ok = write_all(s->fd, b.data, b.len);
+        pthread_mutex_lock(&s->lock);
+
+        if (!ok)
+            s->failed = 1;
+
+        b.len = 0;
+        s->spare[s->spare_count++] = b;
+        pthread_cond_broadcast(&s->cond);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// hands the filled buffer to the output thread and takes a written one back
+void output_stage_push(Writer* w) {
+    OutputStage* s = w->stage;
+    OutputBuffer b = { w->buf, w->len, w->cap };
+
+    pthread_mutex_lock(&s->lock);
+
+    s->full[(s->head + s->full_count++) % OUTPUT_BUFFERS] = b;
+    pthread_cond_broadcast(&s->cond);
+
+    while (s->spare_count == 0)
+        pthread_cond_wait(&s->cond, &s->lock);
+
+    b = s->spare[--s->spare_count];
+    if (s->failed)
+        w->failed = 1;
+
+    pthread_mutex_unlock(&s->lock);
+
+    w->buf = b.data;
+    w->cap = b.cap;
+    w->len = 0;
+}
+
+// writes out the buffer, a mapped writer has nothing to do
+void writer_flush(Writer* w) {
+    if (w->mapped)
+        return;
+
+    if (w->stage) {
+        if (w->len > 0)
+            output_stage_push(w);
+        return;
+    }
+
+    if (w->fd >= 0 && w->len > w->sent && !write_all(w->fd, w->buf + w->sent, w->len - w->sent))
+        w->failed = 1;
+
+    w->len = 0;
+    w->sent = 0;
+    w->ready = 0;
+}
+
+// sends the bytes up to ready that the socket takes without blocking, the rest waits for POLLOUT;
+// the results of a client that is gone are dropped
+void writer_send(Writer* w) {
+    while (!w->failed && w->sent < w->ready) {
+        ssize_t n = write(w->fd, w->buf + w->sent, w->ready - w->sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0)
+            w->failed = 1;
+        else
+            w->sent += (size_t)n;
+    }
+
+    if (w->failed || w->sent == w->len) {
+        w->len = 0;
+        w->sent = 0;
+        w->ready = 0;
+    }
+}
+
+// drops the results that were not written yet and are not ready to be sent
+void writer_discard(Writer* w) {
+    if (!w->mapped)
+        w->len = w->ready;
+}
+
+// grows the file and its mapping to hold at least size bytes
+int writer_remap(Writer* w, size_t size) {
+    size_t cap = w->cap ? w->cap : WRITER_BUFFER_SIZE;
+    while (cap < size)
+        cap *= 2;
+
+    if (w->buf)
+        munmap(w->buf, w->cap);
+    w->buf = NULL;
+    w->cap = 0;
+
+    if (ftruncate(w->fd, (off_t)cap) != 0)
+        return 0;
+
+    void* map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (map == MAP_FAILED)
         return 0;
 
+    w->buf = (char*)map;
+    w->cap = cap;
     return 1;
 }
 
+// makes room for size more bytes, a failed writer drops what doesn't fit
+int writer_reserve(Writer* w, size_t size) {
+    if (w->len + size <= w->cap)
+        return 1;
 
-const char* status_to_string(Status s) {
-    switch (s) {
-        case well: return "'well'";
-        case wearlow: return "'wearlow'";
-        case wearhigh: return "'wearhigh'";
-        case broken: return "'broken'";
-        case notcheck: return "'notcheck'";
+    if (w->failed)
+        return 0;
+
+    if (w->mapped) {
+        if (!writer_remap(w, w->len + size))
+            w->failed = 1;
+        return !w->failed;
     }
-    return "'unknown'";
+
+    // the bytes a client already took make room first
+    if (w->hold && w->sent > 0) {
+        memmove(w->buf, w->buf + w->sent, w->len - w->sent);
+        w->len -= w->sent;
+        w->ready -= w->sent;
+        w->sent = 0;
+    }
+
+    if (!w->hold)
+        writer_flush(w);
+
+    if (w->len + size <= w->cap)
+        return 1;
+
+    size_t cap = w->cap > INITIAL_BUFFER_SIZE ? w->cap : INITIAL_BUFFER_SIZE;
+    while (cap < w->len + size)
+        cap *= BUFFER_GROWTH_FACTOR;
+
+    char* tmp = (char*)db_realloc(w->buf, cap);
+    if (!tmp) {
+        w->failed = 1;
+        return 0;
+    }
+
+    w->buf = tmp;
+    w->cap = cap;
+    return 1;
 }
 
-char* next_token(char** src, char sep) {
-    if (!*src || !**src)
-        return NULL;
+void writer_write(Writer* w, const char* data, size_t size) {
+    if (!writer_reserve(w, size))
+        return;
 
-    char* start = *src;
-    char* p = start;
+    memcpy(w->buf + w->len, data, size);
+    w->len += size;
+}
 
-    int in_quotes = 0;
+void writer_puts(Writer* w, const char* s) {
+    writer_write(w, s, strlen(s));
+}
 
-    while (*p) {
-        if (*p == '\"' && !in_quotes)
-            in_quotes = !in_quotes;
-        else if (*p == '\"' && *(p + 1) == sep)
-            in_quotes = !in_quotes;
-        else if (*p == sep && !in_quotes)
+void writer_putc(Writer* w, char c) {
+    if (w->len < w->cap || writer_reserve(w, 1))
+        w->buf[w->len++] = c;
+}
+
+void writer_int(Writer* w, int value) {
+    char digits[12];
+    int n = 0;
+    unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    if (value < 0)
+        digits[n++] = '-';
+
+    if (!writer_reserve(w, n))
+        return;
+
+    while (n > 0)
+        w->buf[w->len++] = digits[--n];
+}
+
+// the same as printf's %02d
+void writer_int2(Writer* w, int value) {
+    if (value >= 0 && value < 10)
+        writer_putc(w, '0');
+
+    writer_int(w, value);
+}
+
+void writer_printf(Writer* w, const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (n < 0 || !writer_reserve(w, (size_t)n + 1))
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(w->buf + w->len, (size_t)n + 1, fmt, args);
+    va_end(args);
+
+    w->len += n;
+}
+
+// gives the writer an output thread, a writer that cannot get one keeps writing by itself
+void output_stage_start(Writer* w) {
+    if (w->mapped || w->fd < 0)
+        return;
+
+    OutputStage* s = (OutputStage*)db_malloc(sizeof(OutputStage));
+    if (!s)
+        return;
+
+    memset(s, 0, sizeof(OutputStage));
+    s->fd = w->fd;
+
+    // the writer holds one buffer, the others start out written
+    while (s->spare_count < OUTPUT_BUFFERS - 1) {
+        OutputBuffer b = { (char*)db_malloc(WRITER_BUFFER_SIZE), 0, WRITER_BUFFER_SIZE };
+        if (!b.data)
             break;
+        s->spare[s->spare_count++] = b;
+    }
 
-        p++;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (s->spare_count == OUTPUT_BUFFERS - 1 && pthread_create(&s->thread, NULL, output_thread, s) == 0) {
+        w->stage = s;
+        return;
     }
 
-    if (*p == sep) {
-        *p = '\0';
-        *src = p + 1;
-    }else {
-        *src = NULL;
+    while (s->spare_count > 0)
+        db_free(s->spare[--s->spare_count].data);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    db_free(s);
+}
+
+// writes what is left and stops the output thread, the writer goes on by itself
+void output_stage_stop(Writer* w) {
+    OutputStage* s = w->stage;
+    if (!s)
+        return;
+
+    writer_flush(w);
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->thread, NULL);
+
+    if (s->failed)
+        w->failed = 1;
+
+    while (s->spare_count > 0)
+        db_free(s->spare[--s->spare_count].data);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    db_free(s);
+    w->stage = NULL;
+}
+
+// flushes and closes the output, a mapped file is cut down to what was written
+int writer_close(Writer* w) {
+    output_stage_stop(w);
+    writer_flush(w);
+
+    if (w->mapped) {
+        if (w->buf)
+            munmap(w->buf, w->cap);
+        if (w->fd >= 0 && ftruncate(w->fd, (off_t)w->len) != 0)
+            w->failed = 1;
+    } else if (w->buf != NULL) {
+        db_free(w->buf);
     }
 
-    if (*src) *src = trim(*src);
+    if (w->fd >= 0 && close(w->fd) != 0)
+        w->failed = 1;
 
-    return start;
+    int ok = !w->failed;
+    memset(w, 0, sizeof(Writer));
+    w->fd = -1;
+    return ok;
 }
 
+int date_to_int(Date d) {
+    return d.year * 10000 + d.month * 100 + d.day;
+}
 
-// function insert
-void insert_db(char* line, FILE* output, Queue* queue) {
-    Node* new_node = (Node*)malloc(sizeof(Node));
-    cnt_malloc++;
-    char* args = line + 6;
+size_t hash_int(int key) {
+    return (size_t)(((uint64_t)(unsigned int)key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
 
-    char* copy = strdup(args);
-    cnt_strdup++;
-    char* original_copy = copy;
+int id_index_resize(IdIndex* idx, size_t size) {
+    IdPosting* slots = (IdPosting*)db_malloc(size * sizeof(IdPosting));
+    if (!slots)
+        return 0;
+    memset(slots, 0, size * sizeof(IdPosting));
 
-    char* seen[FIELD_COUNT] = { 0 };
+    for (size_t i = 0; i < idx->size; i++) {
+        if (!idx->slots[i].used)
+            continue;
 
-    if (*args == '\0') goto error;
-    if (!copy) goto error;
+        size_t j = hash_int(idx->slots[i].key) & (size - 1);
+        while (slots[j].used)
+            j = (j + 1) & (size - 1);
 
-    copy = trim(copy);
+        slots[j] = idx->slots[i];
+    }
 
-    char* token;
+    db_free(idx->slots);
 
-    while ((token = next_token(&copy, ','))) {
+    idx->slots = slots;
+    idx->size = size;
+    return 1;
+}
 
-        char* eq = strchr(token, '=');
-        if (!eq) goto error;
+// finds the posting list of a key, creates an empty one if asked to
+IdPosting* id_index_posting(IdIndex* idx, int key, int create) {
+    if (create && (idx->keys + 1) * 2 > idx->size && !id_index_resize(idx, idx->size ? idx->size * 2 : 16))
+        return NULL;
 
-        *eq = '\0';
-        char* field = trim(token);
-        char* value = trim(eq + 1);
+    if (idx->size == 0)
+        return NULL;
 
-        if (*field == '\0' || *value == '\0')
-            goto error;
+    size_t i = hash_int(key) & (idx->size - 1);
+
+    while (idx->slots[i].used) {
+        if (idx->slots[i].key == key)
+            return &idx->slots[i];
+        i = (i + 1) & (idx->size - 1);
+    }
+
+    if (!create)
+        return NULL;
+
+    idx->slots[i].used = 1;
+    idx->slots[i].key = key;
+    idx->keys++;
+
+    return &idx->slots[i];
+}
+
+// position of the first entry with rid not less than the given one
+int posting_lower_bound(IdPosting* p, unsigned int rid) {
+    int lo = 0;
+    int hi = p->count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (p->entries[mid].rid < rid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+void id_index_add(IdIndex* idx, Node* n) {
+    if (idx->broken)
+        return;
+
+    IdPosting* p = id_index_posting(idx, n->unit_id, 1);
+    if (!p) {
+        idx->broken = 1;
+        return;
+    }
+
+    if (p->count == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 4;
+
+        IdEntry* tmp = (IdEntry*)db_realloc(p->entries, cap * sizeof(IdEntry));
+        if (!tmp) {
+            idx->broken = 1;
+            return;
+        }
+
+        p->entries = tmp;
+        p->cap = cap;
+    }
+
+    int pos = p->count;
+
+    if (pos > 0 && p->entries[pos - 1].rid > n->rid) {
+        pos = posting_lower_bound(p, n->rid);
+        memmove(&p->entries[pos + 1], &p->entries[pos], (p->count - pos) * sizeof(IdEntry));
+    }
+
+    p->entries[pos].rid = n->rid;
+    p->entries[pos].node = n;
+    p->count++;
+}
+
+// marks the entry of the row as dead, squeezes the list when half of it is dead
+void id_index_remove(IdIndex* idx, Node* n) {
+    if (idx->broken)
+        return;
+
+    IdPosting* p = id_index_posting(idx, n->unit_id, 0);
+    if (!p)
+        return;
+
+    // a row that left this key and came back may have a dead entry with its rid next to the live one
+    int pos = posting_lower_bound(p, n->rid);
+    while (pos < p->count && p->entries[pos].rid == n->rid && p->entries[pos].node != n)
+        pos++;
+
+    if (pos == p->count || p->entries[pos].node != n)
+        return;
+
+    p->entries[pos].node = NULL;
+    p->dead++;
+
+    if (p->dead * 2 > p->count) {
+        int live = 0;
+
+        for (int i = 0; i < p->count; i++)
+            if (p->entries[i].node)
+                p->entries[live++] = p->entries[i];
+
+        p->count = live;
+        p->dead = 0;
+    }
+}
+
+// points the entry of the row at its new version, the key and the rid stay the same
+void id_index_replace(IdIndex* idx, Node* n, Node* v) {
+    if (idx->broken)
+        return;
+
+    IdPosting* p = id_index_posting(idx, n->unit_id, 0);
+    if (!p)
+        return;
+
+    int pos = posting_lower_bound(p, n->rid);
+    while (pos < p->count && p->entries[pos].rid == n->rid && p->entries[pos].node != n)
+        pos++;
+
+    if (pos < p->count && p->entries[pos].node == n)
+        p->entries[pos].node = v;
+}
+
+void free_id_index(IdIndex* idx) {
+    for (size_t i = 0; i < idx->size; i++) {
+        db_free(idx->slots[i].entries);
+    }
+
+    db_free(idx->slots);
+
+    memset(idx, 0, sizeof(IdIndex));
+}
+
+// refills the index from the queue with a table sized for every row having its own key
+void id_index_rebuild(IdIndex* idx, Queue* q) {
+    free_id_index(idx);
+
+    size_t rows = 0;
+    for (Node* cur = q->head; cur; cur = cur->next)
+        rows++;
+
+    size_t size = 16;
+    while (size < rows * 2)
+        size *= 2;
+
+    if (!id_index_resize(idx, size)) {
+        idx->broken = 1;
+        return;
+    }
+
+    for (Node* cur = q->head; cur; cur = cur->next)
+        id_index_add(idx, cur);
+}
+
+// copies the live rows of a key, returns 0 if the index can't answer
+int id_index_lookup(IdIndex* idx, int key, RowSet* set) {
+    set->rows = NULL;
+    set->count = 0;
+
+    if (idx->broken)
+        return 0;
+
+    IdPosting* p = id_index_posting(idx, key, 0);
+    if (!p || p->count == p->dead)
+        return 1;
+
+    set->rows = (Node**)db_malloc((p->count - p->dead) * sizeof(Node*));
+    if (!set->rows)
+        return 0;
+
+    for (int i = 0; i < p->count; i++)
+        if (p->entries[i].node)
+            set->rows[set->count++] = p->entries[i].node;
+
+    return 1;
+}
+
+void free_rowset(RowSet* set) {
+    db_free(set->rows);
+
+    set->rows = NULL;
+    set->count = 0;
+}
+
+// appends a row, cap is the number of rows the set has room for
+int rowset_push(RowSet* set, int* cap, Node* n) {
+    if (set->count == *cap) {
+        int size = *cap ? *cap * 2 : 16;
+
+        Node** tmp = (Node**)db_realloc(set->rows, size * sizeof(Node*));
+        if (!tmp)
+            return 0;
+
+        set->rows = tmp;
+        *cap = size;
+    }
+
+    set->rows[set->count++] = n;
+    return 1;
+}
+
+int date_key_less(DateKey a, DateKey b) {
+    return a.date < b.date || (a.date == b.date && a.rid < b.rid);
+}
+
+// number of keys of the node that are not greater than k
+int btree_upper_bound(BTreeNode* n, DateKey k) {
+    int lo = 0;
+    int hi = n->count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (date_key_less(k, n->keys[mid]))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+// number of keys of the node that are less than k
+int btree_lower_bound(BTreeNode* n, DateKey k) {
+    int lo = 0;
+    int hi = n->count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (date_key_less(n->keys[mid], k))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+BTreeNode* btree_new_node(int leaf) {
+    BTreeNode* n = (BTreeNode*)db_malloc(sizeof(BTreeNode));
+    if (!n)
+        return NULL;
+
+    n->leaf = leaf;
+    n->count = 0;
+    n->next = NULL;
+
+    return n;
+}
+
+// inserts into the subtree, a full node is split and its new right half returned with the separator
+BTreeNode* btree_insert_rec(BTreeNode* n, DateKey k, Node* row, DateKey* sep, int* failed) {
+    if (n->leaf) {
+        int pos = btree_lower_bound(n, k);
+
+        memmove(&n->keys[pos + 1], &n->keys[pos], (n->count - pos) * sizeof(DateKey));
+        memmove(&n->ptr.rows[pos + 1], &n->ptr.rows[pos], (n->count - pos) * sizeof(Node*));
+        n->keys[pos] = k;
+        n->ptr.rows[pos] = row;
+        n->count++;
+
+        if (n->count < BTREE_ORDER)
+            return NULL;
+
+        BTreeNode* right = btree_new_node(1);
+        if (!right) {
+            *failed = 1;
+            return NULL;
+        }
+
+        int mid = n->count / 2;
+        right->count = n->count - mid;
+        memcpy(right->keys, &n->keys[mid], right->count * sizeof(DateKey));
+        memcpy(right->ptr.rows, &n->ptr.rows[mid], right->count * sizeof(Node*));
+        n->count = mid;
+
+        right->next = n->next;
+        n->next = right;
+
+        *sep = right->keys[0];
+        return right;
+    }
+
+    int pos = btree_upper_bound(n, k);
+
+    DateKey child_sep;
+    BTreeNode* child = btree_insert_rec(n->ptr.children[pos], k, row, &child_sep, failed);
+    if (!child)
+        return NULL;
+
+    memmove(&n->keys[pos + 1], &n->keys[pos], (n->count - pos) * sizeof(DateKey));
+    memmove(&n->ptr.children[pos + 2], &n->ptr.children[pos + 1], (n->count - pos) * sizeof(BTreeNode*));
+    n->keys[pos] = child_sep;
+    n->ptr.children[pos + 1] = child;
+    n->count++;
+
+    if (n->count < BTREE_ORDER)
+        return NULL;
+
+    BTreeNode* right = btree_new_node(0);
+    if (!right) {
+        *failed = 1;
+        return NULL;
+    }
+
+    int mid = n->count / 2;
+    *sep = n->keys[mid];
+
+    right->count = n->count - mid - 1;
+    memcpy(right->keys, &n->keys[mid + 1], right->count * sizeof(DateKey));
+    memcpy(right->ptr.children, &n->ptr.children[mid + 1], (right->count + 1) * sizeof(BTreeNode*));
+    n->count = mid;
+
+    return right;
+}
+
+void date_index_add(DateIndex* idx, Node* n) {
+    if (idx->broken)
+        return;
+
+    if (!idx->root) {
+        idx->root = btree_new_node(1);
+        if (!idx->root) {
+            idx->broken = 1;
+            return;
+        }
+    }
+
+    DateKey k = { date_to_int(n->chk_date), n->rid };
+    DateKey sep;
+    int failed = 0;
+
+    BTreeNode* right = btree_insert_rec(idx->root, k, n, &sep, &failed);
+
+    if (right) {
+        BTreeNode* root = btree_new_node(0);
+        if (!root) {
+            failed = 1;
+        } else {
+            root->count = 1;
+            root->keys[0] = sep;
+            root->ptr.children[0] = idx->root;
+            root->ptr.children[1] = right;
+            idx->root = root;
+        }
+    }
+
+    if (failed)
+        idx->broken = 1;
+}
+
+void date_index_remove(DateIndex* idx, Node* n) {
+    if (idx->broken || !idx->root)
+        return;
+
+    DateKey k = { date_to_int(n->chk_date), n->rid };
+    BTreeNode* cur = idx->root;
+
+    while (!cur->leaf)
+        cur = cur->ptr.children[btree_upper_bound(cur, k)];
+
+    int pos = btree_lower_bound(cur, k);
+    if (pos == cur->count || cur->ptr.rows[pos] != n)
+        return;
+
+    memmove(&cur->keys[pos], &cur->keys[pos + 1], (cur->count - pos - 1) * sizeof(DateKey));
+    memmove(&cur->ptr.rows[pos], &cur->ptr.rows[pos + 1], (cur->count - pos - 1) * sizeof(Node*));
+    cur->count--;
+}
+
+// points the leaf entry of the row at its new version, the key stays the same
+void date_index_replace(DateIndex* idx, Node* n, Node* v) {
+    if (idx->broken || !idx->root)
+        return;
+
+    DateKey k = { date_to_int(n->chk_date), n->rid };
+    BTreeNode* cur = idx->root;
+
+    while (!cur->leaf)
+        cur = cur->ptr.children[btree_upper_bound(cur, k)];
+
+    int pos = btree_lower_bound(cur, k);
+    if (pos < cur->count && cur->ptr.rows[pos] == n)
+        cur->ptr.rows[pos] = v;
+}
+
+void free_btree(BTreeNode* n) {
+    if (!n)
+        return;
+
+    if (!n->leaf)
+        for (int i = 0; i <= n->count; i++)
+            free_btree(n->ptr.children[i]);
+
+    db_free(n);
+}
+
+void free_date_index(DateIndex* idx) {
+    free_btree(idx->root);
+    idx->root = NULL;
+    idx->broken = 0;
+}
+
+int compare_rid(const void* a, const void* b) {
+    unsigned int ra = (*(Node* const*)a)->rid;
+    unsigned int rb = (*(Node* const*)b)->rid;
+
+    return (ra > rb) - (ra < rb);
+}
+
+// rows with chk_date in [lo, hi] in queue order, gives up (returns 0) past limit rows
+int date_index_range(DateIndex* idx, int lo, int hi, int limit, RowSet* set) {
+    set->rows = NULL;
+    set->count = 0;
+
+    if (idx->broken)
+        return 0;
+
+    if (!idx->root || lo > hi)
+        return 1;
+
+    DateKey k = { lo, 0 };
+    BTreeNode* cur = idx->root;
+
+    while (!cur->leaf)
+        cur = cur->ptr.children[btree_upper_bound(cur, k)];
+
+    int pos = btree_lower_bound(cur, k);
+    int cap = 0;
+
+    for (; cur; cur = cur->next, pos = 0) {
+        for (; pos < cur->count; pos++) {
+            if (cur->keys[pos].date > hi)
+                goto done;
+
+            if (set->count == limit) {
+                free_rowset(set);
+                return 0;
+            }
+
+            if (!rowset_push(set, &cap, cur->ptr.rows[pos])) {
+                free_rowset(set);
+                return 0;
+            }
+        }
+    }
+
+done:
+    if (set->count > 1)
+        qsort(set->rows, set->count, sizeof(Node*), compare_rid);
+    return 1;
+}
+
+typedef struct {
+    DateKey key;
+    Node* row;
+} DateEntry;
+
+int compare_date_entry(const void* a, const void* b) {
+    const DateEntry* x = (const DateEntry*)a;
+    const DateEntry* y = (const DateEntry*)b;
+
+    return date_key_less(y->key, x->key) - date_key_less(x->key, y->key);
+}
+
+// bulk loads the tree from the queue: sorted entries fill the leaves left to right,
+// then each upper level is built over the one below it
+void date_index_rebuild(DateIndex* idx, Queue* q) {
+    free_date_index(idx);
+
+    int count = 0;
+    for (Node* cur = q->head; cur; cur = cur->next)
+        count++;
+
+    if (count == 0)
+        return;
+
+    int per_leaf = BTREE_ORDER * 3 / 4;
+    int leaves = (count + per_leaf - 1) / per_leaf;
+
+    int total = leaves;
+    for (int c = leaves; c > 1; ) {
+        c = (c + BTREE_ORDER - 1) / BTREE_ORDER;
+        total += c;
+    }
+
+    DateEntry* entries = (DateEntry*)db_malloc(count * sizeof(DateEntry));
+    BTreeNode** nodes = (BTreeNode**)db_malloc(total * sizeof(BTreeNode*));
+    DateKey* mins = (DateKey*)db_malloc(total * sizeof(DateKey));
+
+    int allocated = 0;
+
+    if (!entries || !nodes || !mins)
+        goto fail;
+
+    for (; allocated < total; allocated++) {
+        nodes[allocated] = btree_new_node(allocated < leaves);
+        if (!nodes[allocated])
+            goto fail;
+    }
+
+    int i = 0;
+    for (Node* cur = q->head; cur; cur = cur->next, i++) {
+        entries[i].key.date = date_to_int(cur->chk_date);
+        entries[i].key.rid = cur->rid;
+        entries[i].row = cur;
+    }
+
+    qsort(entries, count, sizeof(DateEntry), compare_date_entry);
+
+    for (int l = 0; l < leaves; l++) {
+        BTreeNode* leaf = nodes[l];
+        int start = l * per_leaf;
+        int end = start + per_leaf < count ? start + per_leaf : count;
+
+        for (int j = start; j < end; j++) {
+            leaf->keys[j - start] = entries[j].key;
+            leaf->ptr.rows[j - start] = entries[j].row;
+        }
+
+        leaf->count = end - start;
+        leaf->next = l + 1 < leaves ? nodes[l + 1] : NULL;
+        mins[l] = leaf->keys[0];
+    }
+
+    int first = 0;
+    int width = leaves;
+    int next = leaves;
+
+    while (width > 1) {
+        int parents = 0;
+
+        for (int c = 0; c < width; c += BTREE_ORDER) {
+            int end = c + BTREE_ORDER < width ? c + BTREE_ORDER : width;
+            BTreeNode* p = nodes[next + parents];
+
+            p->count = end - c - 1;
+            for (int j = c; j < end; j++) {
+                p->ptr.children[j - c] = nodes[first + j];
+                if (j > c)
+                    p->keys[j - c - 1] = mins[first + j];
+            }
+
+            mins[next + parents] = mins[first + c];
+            parents++;
+        }
+
+        first = next;
+        next += parents;
+        width = parents;
+    }
+
+    idx->root = nodes[first];
+    goto cleanup;
+
+fail:
+    for (int j = 0; j < allocated; j++) {
+        db_free(nodes[j]);
+    }
+    idx->broken = 1;
+
+cleanup:
+    db_free(entries);
+    db_free(nodes);
+    db_free(mins);
+}
+
+// position of the first value of the array not less than low
+int status_chunk_lower_bound(StatusChunk* c, uint16_t low) {
+    int lo = 0;
+    int hi = c->count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (c->values[mid] < low)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// container for the low 16 bits of rid, an array while it holds at most STATUS_ARRAY_MAX of them
+int status_chunk_add(StatusChunk* c, uint16_t low) {
+    if (c->bits) {
+        uint64_t bit = 1ull << (low & 63);
+        if (!(c->bits[low >> 6] & bit)) {
+            c->bits[low >> 6] |= bit;
+            c->count++;
+        }
+        return 1;
+    }
+
+    int lo = status_chunk_lower_bound(c, low);
+
+    if (lo < c->count && c->values[lo] == low)
+        return 1;
+
+    // a full array becomes a bitmap
+    if (c->count == STATUS_ARRAY_MAX) {
+        uint64_t* bits = (uint64_t*)db_malloc(STATUS_CHUNK_WORDS * sizeof(uint64_t));
+        if (!bits)
+            return 0;
+        memset(bits, 0, STATUS_CHUNK_WORDS * sizeof(uint64_t));
+
+        for (int i = 0; i < c->count; i++)
+            bits[c->values[i] >> 6] |= 1ull << (c->values[i] & 63);
+
+        db_free(c->values);
+        c->values = NULL;
+        c->cap = 0;
+        c->bits = bits;
+        return status_chunk_add(c, low);
+    }
+
+    if (c->count == c->cap) {
+        int cap = c->cap ? c->cap * 2 : 16;
+        uint16_t* tmp = (uint16_t*)db_realloc(c->values, cap * sizeof(uint16_t));
+        if (!tmp)
+            return 0;
+
+        c->values = tmp;
+        c->cap = cap;
+    }
+
+    memmove(&c->values[lo + 1], &c->values[lo], (c->count - lo) * sizeof(uint16_t));
+    c->values[lo] = low;
+    c->count++;
+    return 1;
+}
+
+// a bitmap that shrinks to a quarter of the array limit goes back to an array, the gap keeps
+// a chunk near the limit from switching on every change
+int status_chunk_remove(StatusChunk* c, uint16_t low) {
+    if (c->bits) {
+        uint64_t bit = 1ull << (low & 63);
+        if (!(c->bits[low >> 6] & bit))
+            return 1;
+
+        c->bits[low >> 6] &= ~bit;
+        c->count--;
+
+        if (c->count > STATUS_ARRAY_MAX / 4)
+            return 1;
+
+        uint16_t* values = (uint16_t*)db_malloc((c->count ? c->count : 1) * sizeof(uint16_t));
+        if (!values)
+            return 1;
+
+        int n = 0;
+        for (int w = 0; w < STATUS_CHUNK_WORDS; w++)
+            for (uint64_t word = c->bits[w]; word; word &= word - 1)
+                values[n++] = (uint16_t)(w * 64 + __builtin_ctzll(word));
+
+        db_free(c->bits);
+        c->bits = NULL;
+        c->values = values;
+        c->cap = c->count ? c->count : 1;
+        return 1;
+    }
+
+    int i = status_chunk_lower_bound(c, low);
+
+    if (i < c->count && c->values[i] == low) {
+        memmove(&c->values[i], &c->values[i + 1], (c->count - i - 1) * sizeof(uint16_t));
+        c->count--;
+    }
+
+    return 1;
+}
+
+void free_status_index(StatusIndex* idx) {
+    for (size_t i = 0; i < (size_t)idx->chunk_cap * MAX_STATUS; i++) {
+        db_free(idx->chunks[i].values);
+        db_free(idx->chunks[i].bits);
+    }
+
+    db_free(idx->chunks);
+    memset(idx, 0, sizeof(StatusIndex));
+}
+
+void status_index_add(StatusIndex* idx, Node* n) {
+    if (idx->broken)
+        return;
+
+    unsigned int chunk = n->rid >> 16;
+
+    if (chunk >= idx->chunk_cap) {
+        unsigned int cap = idx->chunk_cap ? idx->chunk_cap : 16;
+        while (cap <= chunk)
+            cap *= 2;
+
+        StatusChunk* tmp = (StatusChunk*)db_realloc(idx->chunks, (size_t)cap * MAX_STATUS * sizeof(StatusChunk));
+        if (!tmp) {
+            free_status_index(idx);
+            idx->broken = 1;
+            return;
+        }
+
+        memset(&tmp[(size_t)idx->chunk_cap * MAX_STATUS], 0, (size_t)(cap - idx->chunk_cap) * MAX_STATUS * sizeof(StatusChunk));
+        idx->chunks = tmp;
+        idx->chunk_cap = cap;
+    }
+
+    if (!status_chunk_add(&idx->chunks[(size_t)chunk * MAX_STATUS + n->status], (uint16_t)n->rid)) {
+        free_status_index(idx);
+        idx->broken = 1;
+        return;
+    }
+
+    idx->counts[n->status]++;
+}
+
+void status_index_remove(StatusIndex* idx, Node* n) {
+    unsigned int chunk = n->rid >> 16;
+
+    if (idx->broken || chunk >= idx->chunk_cap)
+        return;
+
+    StatusChunk* c = &idx->chunks[(size_t)chunk * MAX_STATUS + n->status];
+    int count = c->count;
+
+    status_chunk_remove(c, (uint16_t)n->rid);
+    idx->counts[n->status] -= count - c->count;
+}
+
+void status_index_rebuild(StatusIndex* idx, Queue* q) {
+    free_status_index(idx);
+
+    for (Node* cur = q->head; cur && !idx->broken; cur = cur->next)
+        status_index_add(idx, cur);
+}
+
+// rows whose status is in mask, in queue order: the chunks of those statuses are merged into
+// one bitmap per 65536 rids that is read in rid order; gives up (returns 0) past limit rows
+int status_index_lookup(StatusIndex* idx, Queue* q, unsigned int mask, int limit, RowSet* set) {
+    set->rows = NULL;
+    set->count = 0;
+
+    if (idx->broken)
+        return 0;
+
+    int total = 0;
+    for (int s = 0; s < MAX_STATUS; s++)
+        if (mask & (1u << s))
+            total += idx->counts[s];
+
+    if (total > limit)
+        return 0;
+
+    if (total == 0)
+        return 1;
+
+    set->rows = (Node**)db_malloc(total * sizeof(Node*));
+    if (!set->rows)
+        return 0;
+
+    uint64_t words[STATUS_CHUNK_WORDS];
+
+    for (unsigned int chunk = 0; chunk < idx->chunk_cap; chunk++) {
+        StatusChunk* chunks = &idx->chunks[(size_t)chunk * MAX_STATUS];
+        int used = 0;
+
+        for (int s = 0; s < MAX_STATUS; s++) {
+            StatusChunk* c = &chunks[s];
+            if (!(mask & (1u << s)) || c->count == 0)
+                continue;
+
+            if (!used)
+                memset(words, 0, sizeof(words));
+            used = 1;
+
+            if (c->bits) {
+                for (int w = 0; w < STATUS_CHUNK_WORDS; w++)
+                    words[w] |= c->bits[w];
+            } else {
+                for (int i = 0; i < c->count; i++)
+                    words[c->values[i] >> 6] |= 1ull << (c->values[i] & 63);
+            }
+        }
+
+        if (!used)
+            continue;
+
+        for (int w = 0; w < STATUS_CHUNK_WORDS; w++)
+            for (uint64_t word = words[w]; word; word &= word - 1)
+                set->rows[set->count++] = q->rows[(chunk << 16) | (unsigned int)(w * 64 + __builtin_ctzll(word))];
+    }
+
+    return 1;
+}
+
+// the indexes are rebuilt by the first query that needs them
+void drop_indexes(Queue* q) {
+    free_id_index(&q->id_index);
+    free_date_index(&q->date_index);
+    free_status_index(&q->status_index);
+    q->id_index.broken = 1;
+    q->date_index.broken = 1;
+    q->status_index.broken = 1;
+}
+
+// room for count more retired entries, so a command never fails half way through retiring
+int reserve_retired(Versions* v, size_t count) {
+    if (v->head + v->count + count <= v->cap)
+        return 1;
+
+    if (v->head > 0) {
+        memmove(v->items, v->items + v->head, v->count * sizeof(Retired));
+        v->head = 0;
+    }
+
+    if (v->count + count <= v->cap)
+        return 1;
+
+    size_t cap = v->cap ? v->cap : 1024;
+    while (cap < v->count + count)
+        cap *= 2;
+
+    Retired* tmp = (Retired*)db_realloc(v->items, cap * sizeof(Retired));
+    if (!tmp)
+        return 0;
+
+    v->items = tmp;
+    v->cap = cap;
+    return 1;
+}
+
+// the entries are in lsn order, so the oldest snapshot frees them from the front;
+// there is always room after reserve_retired or after an entry was taken from the front
+void retire(Versions* v, void* ptr, int kind, uint64_t lsn) {
+    if (v->head + v->count == v->cap) {
+        memmove(v->items, v->items + v->head, v->count * sizeof(Retired));
+        v->head = 0;
+    }
+
+    Retired* r = &v->items[v->head + v->count++];
+    r->ptr = ptr;
+    r->lsn = lsn;
+    r->kind = kind;
+}
+
+// gives reindex and sort a directory of their own to renumber while the snapshots read the old one
+int replace_rows(Queue* q) {
+    if (!q->versions.snapshots)
+        return 1;
+
+    if (!reserve_retired(&q->versions, 1))
+        return 0;
+
+    Node** rows = (Node**)db_malloc(q->rows_cap * sizeof(Node*));
+    if (!rows)
+        return 0;
+
+    retire(&q->versions, q->rows, RETIRED_DIRECTORY, q->lsn + 1);
+    q->rows = rows;
+    return 1;
+}
+
+// restores prev links, tail, rids and the rid directory after the list was relinked
+// and drops the indexes; with snapshots open the directory must be a fresh one from replace_rows
+void renumber_rows(Queue* q) {
+    Node* prev = NULL;
+    unsigned int rid = 0;
+
+    for (Node* cur = q->head; cur; cur = cur->next) {
+        cur->prev = prev;
+        cur->rid = rid;
+        q->rows[rid++] = cur;
+        prev = cur;
+    }
+
+    q->tail = prev;
+    q->next_rid = rid;
+    q->holes = 0;
+
+    drop_indexes(q);
+}
+
+// renumbers the rows of a list whose links are intact; while snapshots are open and there is
+// no memory for a new directory the rows keep their numbers
+void reindex_queue(Queue* q) {
+    if (replace_rows(q))
+        renumber_rows(q);
+}
+
+// adds the row to the indexes over the given fields (a mask of 1 << field)
+void index_node(Queue* q, Node* n, int fields) {
+    if (fields & (1 << 0))
+        id_index_add(&q->id_index, n);
+
+    if (fields & (1 << 3))
+        date_index_add(&q->date_index, n);
+
+    if (fields & (1 << 4))
+        status_index_add(&q->status_index, n);
+}
+
+// removes the row from the indexes over the given fields, must see the values the row was indexed with
+void unindex_node(Queue* q, Node* n, int fields) {
+    if (fields & (1 << 0))
+        id_index_remove(&q->id_index, n);
+
+    if (fields & (1 << 3))
+        date_index_remove(&q->date_index, n);
+
+    if (fields & (1 << 4))
+        status_index_remove(&q->status_index, n);
+}
+
+// grows the rid directory to hold at least count rows
+int reserve_rows(Queue* q, unsigned int count) {
+    if (count <= q->rows_cap)
+        return 1;
+
+    size_t cap = q->rows_cap ? q->rows_cap : 1024;
+    while (cap < count)
+        cap *= 2;
+    if (cap > UINT_MAX)
+        cap = UINT_MAX;
+
+    // the open snapshots go on reading the old directory
+    if (q->versions.snapshots) {
+        if (!reserve_retired(&q->versions, 1))
+            return 0;
+
+        Node** rows = (Node**)db_malloc(cap * sizeof(Node*));
+        if (!rows)
+            return 0;
+
+        if (q->next_rid > 0)
+            memcpy(rows, q->rows, q->next_rid * sizeof(Node*));
+
+        retire(&q->versions, q->rows, RETIRED_DIRECTORY, q->lsn + 1);
+        q->rows = rows;
+        q->rows_cap = (unsigned int)cap;
+        return 1;
+    }
+
+    Node** tmp = (Node**)db_realloc(q->rows, cap * sizeof(Node*));
+    if (!tmp)
+        return 0;
+
+    q->rows = tmp;
+    q->rows_cap = (unsigned int)cap;
+    return 1;
+}
+
+// renumbers the rows once more than half of the directory is deleted rows
+void compact_rows(Queue* q) {
+    if (q->holes > q->next_rid / 2)
+        reindex_queue(q);
+}
+
+// puts the row at the end of the list and the rid directory without indexing it
+int link_node(Queue* q, Node* n) {
+    if (q->next_rid == UINT_MAX)
+        reindex_queue(q);
+
+    if (!reserve_rows(q, q->next_rid + 1))
+        return 0;
+
+    n->begin = q->lsn + 1;
+    n->end = VERSION_LIVE;
+    n->older = NULL;
+
+    q->rows[q->next_rid] = n;
+    n->rid = q->next_rid++;
+    n->next = NULL;
+    n->prev = q->tail;
+
+    if (q->head == NULL)
+        q->head = n;
+    else
+        q->tail->next = n;
+
+    q->tail = n;
+    return 1;
+}
+
+int append_node(Queue* q, Node* n) {
+    if (!link_node(q, n))
+        return 0;
+
+    index_node(q, n, INDEXED_FIELDS);
+    return 1;
+}
+
+// takes a row out of the list and the indexes, the record itself is dropped by the caller;
+// while snapshots are open the row keeps its slot in the rid directory and only gets an end
+void unlink_node(Queue* q, Node* n) {
+    if (n->prev)
+        n->prev->next = n->next;
+    else
+        q->head = n->next;
+
+    if (n->next)
+        n->next->prev = n->prev;
+    else
+        q->tail = n->prev;
+
+    if (q->versions.snapshots)
+        __atomic_store_n(&n->end, q->lsn + 1, __ATOMIC_RELEASE);
+    else
+        q->rows[n->rid] = NULL;
+
+    q->holes++;
+
+    unindex_node(q, n, INDEXED_FIELDS);
+}
+
+// frees a row taken out by unlink_node, or leaves it to the snapshots that may still read it
+void drop_node(Queue* q, Node* n) {
+    if (q->versions.snapshots) {
+        retire(&q->versions, n, RETIRED_ROW, n->end);
+        return;
+    }
+
+    release_row_strings(&q->strings, n);
+    release_node(&q->pool, n);
+}
+
+// row of the rid directory as the writer sees it, a deleted row that snapshots still read is skipped
+Node* live_row(Queue* q, unsigned int rid) {
+    Node* n = q->rows[rid];
+    return n && n->end == VERSION_LIVE ? n : NULL;
+}
+
+// version of the row in slot rid that the snapshot sees, NULL if there is none; runs next to
+// the writer, which only adds versions in front of the ones a snapshot may follow
+Node* snapshot_row(const Snapshot* s, unsigned int rid) {
+    Node* n = __atomic_load_n(&s->rows[rid], __ATOMIC_ACQUIRE);
+
+    while (n && n->begin > s->lsn)
+        n = n->older;
+
+    if (n && __atomic_load_n(&n->end, __ATOMIC_ACQUIRE) <= s->lsn)
+        return NULL;
+
+    return n;
+}
+
+// puts a copy of the row in its place in the list, the rid directory and the indexes, so the
+// command changes the copy and the snapshots taken before it still read the row
+Node* new_version(Queue* q, Node* n, Node* v) {
+    *v = *n;
+    v->begin = q->lsn + 1;
+    v->older = n;
+    hold_row_strings(&q->strings, v);
+
+    if (v->prev)
+        v->prev->next = v;
+    else
+        q->head = v;
+
+    if (v->next)
+        v->next->prev = v;
+    else
+        q->tail = v;
+
+    id_index_replace(&q->id_index, n, v);
+    date_index_replace(&q->date_index, n, v);
+
+    __atomic_store_n(&q->rows[n->rid], v, __ATOMIC_RELEASE);
+    __atomic_store_n(&n->end, v->begin, __ATOMIC_RELEASE);
+
+    retire(&q->versions, n, RETIRED_VERSION, v->begin);
+    q->versions.versions++;
+    return v;
+}
+
+// frees what no open snapshot can reach any more, runs on the writer between two commands
+void reclaim_versions(Queue* q) {
+    Versions* v = &q->versions;
+    uint64_t oldest = v->snapshots ? v->oldest : VERSION_LIVE;
+
+    while (v->count > 0 && v->items[v->head].lsn <= oldest) {
+        Retired r = v->items[v->head++];
+        v->count--;
+
+        if (r.kind == RETIRED_DIRECTORY) {
+            db_free(r.ptr);
+            continue;
+        }
+
+        Node* n = (Node*)r.ptr;
+
+        // no snapshot sees the deleted row any more, but one may be reading its slot right now,
+        // so the row itself waits for the snapshots taken before the slot was cleared
+        if (r.kind == RETIRED_ROW) {
+            if (n->rid < q->next_rid && q->rows[n->rid] == n)
+                __atomic_store_n(&q->rows[n->rid], NULL, __ATOMIC_RELEASE);
+
+            if (v->snapshots) {
+                retire(v, n, RETIRED_VERSION, q->lsn + 1);
+                continue;
+            }
+        }
+
+        release_row_strings(&q->strings, n);
+        release_node(&q->pool, n);
+    }
+
+    if (v->count == 0)
+        v->head = 0;
+}
+
+// function of removing spaces
+char* trim(char* s)
+{
+    while (*s == ' ')
+        s++;
+
+    char* end = s + strlen(s) - 1;
+
+    while (end > s && *end == ' ') {
+        *end = '\0';
+        end--;
+    }
+
+    return s;
+}
+
+// function of parsing int
+int parse_int(const char* s, int* out) {
+    char* end;
+    long val = strtol(s, &end, 10);
+
+    if (*s == '\0' || *end != '\0')
+        return 0;
+    
+    if (val <= INT_MAX && val >= INT_MIN) {
+        *out = (int)val;
+        return 1;
+    }
+    return 0;
+}
+
+// function of parsing string with double quotes, out points to the unquoted text inside value
+int parse_double_quoted_string(char* value, const char** out)
+{
+    size_t len = strlen(value);
+
+    if (len < 2)
+        return 0;
+
+    if (value[0] != '"' || value[len - 1] != '"')
+        return 0;
+
+    value[len - 1] = '\0';
+    value++;
+
+    if (strlen(value) >= MAX_STRING_LEN)
+        return 0;
+
+    *out = value;
+
+    return 1;
+}
+
+// letter verification function for carnum
+int valid_letter(char c) {
+    const char* allowed = "ABCEHKMOPTXY";
+    return strchr(allowed, c) != NULL;
+}
+
+// function of parsing carnum, out points to the unquoted carnum inside value
+int parse_carnum(char* value, const char** out) {
+    size_t len = strlen(value);
+
+    if (len < 2 || value[0] != '\'' || value[len - 1] != '\'')
+        return 0;
+
+    value[len - 1] = '\0';
+    value++;
+
+    len = strlen(value);
+
+    if (len != 8 && len != 9)
+        return 0;
+
+    if (!valid_letter(value[0]))
+        return 0;
+
+    for (int i = 1; i <= 3; i++)
+        if (!isdigit(value[i]))
+            return 0;
+
+    if (!valid_letter(value[4]) || !valid_letter(value[5]))
+        return 0;
+
+    for (int i = 6; i < (int)len; i++)
+        if (!isdigit(value[i]))
+            return 0;
+
+    *out = value;
+
+    return 1;
+}
+
+int carnum_digits(const char* s, int start, int len) {
+    int v = 0;
+
+    for (int i = 0; i < len; i++)
+        v = v * 10 + (s[start + i] - '0');
+
+    return v;
+}
+
+// packs a carnum into a key ordered by number, then letters, then region;
+// region numbers are compared as integers, so 'A123BC05' and 'A123BC005' get the same key
+uint64_t carnum_key(const char* s) {
+    uint64_t num = (uint64_t)carnum_digits(s, 1, 3);
+    uint64_t reg = (uint64_t)carnum_digits(s, 6, (int)strlen(s) - 6);
+
+    return num << 40
+        | (uint64_t)(unsigned char)s[0] << 32
+        | (uint64_t)(unsigned char)s[4] << 24
+        | (uint64_t)(unsigned char)s[5] << 16
+        | reg;
+}
+
+// cheaking leap year
+int is_leap(int y) {
+    return (y % 4 == 0 && y % 100 != 0) || (y % 400 == 0);
+}
+
+// checking day
+int days_in_month(int m, int y) {
+    static int d[] = {
+        31,28,31,30,31,30,
+        31,31,30,31,30,31
+    };
+
+    if (m == 2 && is_leap(y))
+        return 29;
+
+    return d[m - 1];
+}
+
+// function of parsing date
+int parse_date(char* value, Date* out) {
+    size_t len = strlen(value);
+
+    if (len < 8)
+        return 0;
+
+    if (value[0] != '\'' || value[len - 1] != '\'')
+        return 0;
+
+    value[len - 1] = '\0';
+    value++;
+
+    int d, m, y;
+
+    if (sscanf(value, "%d.%d.%d", &d, &m, &y) != 3)
+        return 0;
+
+    if (y < 1000 || y > 2026)
+        return 0;
+
+    if (m < 1 || m > 12)
+        return 0;
+
+    int maxd = days_in_month(m, y);
+
+    if (d < 1 || d > maxd)
+        return 0;
+
+    out->day = d;
+    out->month = m;
+    out->year = y;
+
+    return 1;
+}
+
+// function of parsing status
+int parse_status(char* value, Status* out) {
+    size_t len = strlen(value);
+
+    if (len < 2)
+        return 0;
+
+    if (value[0] != '\'' || value[len - 1] != '\'')
+        return 0;
+
+    value[len - 1] = '\0';
+    value++;
+
+    if (strcmp(value, "well") == 0)
+        *out = well;
+    else if (strcmp(value, "wearlow") == 0)
+        *out = wearlow;
+    else if (strcmp(value, "wearhigh") == 0)
+        *out = wearhigh;
+    else if (strcmp(value, "broken") == 0)
+        *out = broken;
+    else if (strcmp(value, "notcheck") == 0)
+        *out = notcheck;
+    else
+        return 0;
+
+    return 1;
+}
+
+
+const char* status_to_string(Status s) {
+    switch (s) {
+        case well: return "'well'";
+        case wearlow: return "'wearlow'";
+        case wearhigh: return "'wearhigh'";
+        case broken: return "'broken'";
+        case notcheck: return "'notcheck'";
+    }
+    return "'unknown'";
+}
+
+char* next_token(char** src, char sep) {
+    if (!*src || !**src)
+        return NULL;
+
+    char* start = *src;
+    char* p = start;
+
+    int in_quotes = 0;
+
+    while (*p) {
+        if (*p == '\"' && !in_quotes)
+            in_quotes = !in_quotes;
+        else if (*p == '\"' && *(p + 1) == sep)
+            in_quotes = !in_quotes;
+        else if (*p == sep && !in_quotes)
+            break;
+
+        p++;
+    }
+
+    if (*p == sep) {
+        *p = '\0';
+        *src = p + 1;
+    }else {
+        *src = NULL;
+    }
+
+    if (*src) *src = trim(*src);
+
+    return start;
+}
+
+
+// function insert
+int insert_db(char* line, Writer* output, Queue* queue) {
+    Node* new_node = alloc_node(&queue->pool);
+    char* args = line + 6;
+
+    char* copy = db_strdup(args);
+    char* original_copy = copy;
+
+    char* seen[FIELD_COUNT] = { 0 };
+
+    if (!new_node) goto error;
+    if (*args == '\0') goto error;
+    if (!copy) goto error;
+
+    copy = trim(copy);
+
+    char* token;
+
+    while ((token = next_token(&copy, ','))) {
+
+        char* eq = strchr(token, '=');
+        if (!eq) goto error;
+
+        *eq = '\0';
+        char* field = trim(token);
+        char* value = trim(eq + 1);
+
+        if (*field == '\0' || *value == '\0')
+            goto error;
+
+        int found = 0;
+
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if (strcmp(field, field_names[i]) == 0) {
+                if (seen[i]) goto error;
+                seen[i] = value;
+                found = 1;
+                break;
+            }
+        }
+
+        if (!found)
+            goto error;
+    }
+
+    for (int i = 0; i < FIELD_COUNT; i++)
+        if (!seen[i]) goto error;
+
+
+    const char* unit_model;
+    const char* carnum;
+    const char* mechanic;
+    const char* driver;
+
+    if (!parse_int(seen[0], &new_node->unit_id)) {
+        goto error;
+    }
+    if (!parse_double_quoted_string(seen[1], &unit_model)) {
+        goto error;
+    }
+    if (!parse_carnum(seen[2], &carnum)) {
+        goto error;
+    }
+    if (!parse_date(seen[3], &new_node->chk_date)) {
+        goto error;
+    }
+    if (!parse_status(seen[4], &new_node->status)) {
+        goto error;
+    }
+    if (!parse_double_quoted_string(seen[5], &mechanic)) {
+        goto error;
+    }
+    if (!parse_double_quoted_string(seen[6], &driver)) {
+        goto error;
+    }
+
+    new_node->unit_model = arena_strdup(&queue->strings, unit_model);
+    new_node->carnum = arena_strdup(&queue->strings, carnum);
+    new_node->car_key = carnum_key(carnum);
+    new_node->mechanic = arena_strdup(&queue->strings, mechanic);
+    new_node->driver = arena_strdup(&queue->strings, driver);
+
+    if (!new_node->unit_model || !new_node->carnum || !new_node->mechanic || !new_node->driver
+        || !append_node(queue, new_node)) {
+        release_row_strings(&queue->strings, new_node);
+        goto error;
+    }
+
+    writer_write(output, "insert:", 7);
+    writer_int(output, ++queue->size);
+    writer_putc(output, '\n');
+    db_free(original_copy);
+    return 1;
+
+error:
+    writer_printf(output, "incorrect:'%.20s'\n", line);
+    db_free(original_copy);
+    release_node(&queue->pool, new_node);
+    return -1;
+}
+
+
+int parse_field_list(char* str, int** fields, int* count) {
+    *fields = NULL;
+    *count = 0;
+
+    char* token;
+
+    while ((token = next_token(&str, ','))) {
+
+        token = trim(token);
+
+        int field = -1;
+
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if (strcmp(token, field_names[i]) == 0) {
+                field = i;
+                break;
+            }
+        }
+
+        if (field == -1)
+            return 0;
+
+        int* tmp = (int*)db_realloc(*fields, (*count + 1) * sizeof(int));
+        if (!tmp)
+            return 0;
+
+        *fields = tmp;
+        (*fields)[*count] = field;
+
+        (*count)++;
+    }
+
+    return *count > 0;
+}
+
+
+
+// name= prefixes of the printed fields and the printed status values
+const char* field_prefixes[FIELD_COUNT] = {
+    "unit_id=",
+    "unit_model=\"",
+    "car_id='",
+    "chk_date='",
+    "status=",
+    "mechanic=\"",
+    "driver=\""
+};
+
+const char* status_literals[MAX_STATUS] = {
+    "'well'",
+    "'wearlow'",
+    "'wearhigh'",
+    "'broken'",
+    "'notcheck'"
+};
+
+void print_field(Writer* out, Node* n, int field) {
+    writer_puts(out, field_prefixes[field]);
+
+    switch (field) {
+
+    case 0:
+        writer_int(out, n->unit_id);
+        break;
+
+    case 1:
+        writer_puts(out, n->unit_model);
+        writer_putc(out, '"');
+        break;
+
+    case 2:
+        writer_puts(out, n->carnum);
+        writer_putc(out, '\'');
+        break;
+
+    case 3:
+        writer_int2(out, n->chk_date.day);
+        writer_putc(out, '.');
+        writer_int2(out, n->chk_date.month);
+        writer_putc(out, '.');
+        writer_int(out, n->chk_date.year);
+        writer_putc(out, '\'');
+        break;
+
+    case 4:
+        writer_puts(out, (unsigned int)n->status < MAX_STATUS ? status_literals[n->status] : status_to_string(n->status));
+        break;
+
+    case 5:
+        writer_puts(out, n->mechanic);
+        writer_putc(out, '"');
+        break;
+
+    case 6:
+        writer_puts(out, n->driver);
+        writer_putc(out, '"');
+        break;
+    }
+}
+
+Operator parse_operator(char** p) {
+    char* s = *p;
+
+    if (strncmp(s, "/not_in/", 8) == 0) {
+        **p = '\0';
+        *p += 8;
+        return OP_NOT_IN;
+    }
+
+    if (strncmp(s, "/in/", 4) == 0) {
+        **p = '\0';
+        *p += 4;
+        return OP_IN;
+    }
+
+    if (strncmp(s, ">=", 2) == 0) {
+        **p = '\0';
+        *p += 2;
+        return OP_GE;
+    }
+
+    if (strncmp(s, "<=", 2) == 0) {
+        **p = '\0';
+        *p += 2;
+        return OP_LE;
+    }
+
+    if (strncmp(s, "==", 2) == 0) {
+        **p = '\0';
+        *p += 2;
+        return OP_EQ;
+    }
+
+    if (strncmp(s, "!=", 2) == 0) {
+        **p = '\0';
+        *p += 2;
+        return OP_NE;
+    }
+
+    if (*s == '>') {
+        **p = '\0';
+        (*p)++;
+        return OP_GT;
+    }
+
+    if (*s == '<') {
+        **p = '\0';
+        (*p)++;
+        return OP_LT;
+    }
+
+    return (Operator)-1;
+}
+
+int parse_condition_value(Condition* c, char* value) {
+    switch (c->field) {
+        case 0:
+            return parse_int(value, &c->value.i);
+
+        case 1:
+            return parse_double_quoted_string(value, &c->value.str);
+
+        case 2:
+            return parse_carnum(value, &c->value.carnum);
+
+        case 3:
+            return parse_date(value, &c->value.date);
+
+        case 4:
+            if (value[0] == '[') {
+                size_t len = strlen(value);
+                value[len - 1] = '\0';
+                value++;
+
+                c->value.status.count = 0;
+
+                if (*value == '\0')
+                    return 1;
+
+                char* token;
+                while ((token = next_token(&value, ','))) {
+                    if (c->value.status.count >= MAX_STATUS)
+                        return 0;
+
+                    token = trim(token);
+                    if (!parse_status(token, &c->value.status.list[c->value.status.count])) return 0;
+                    c->value.status.count++;
+                }
+                return 1;
+            }
+            else {
+                c->value.status.count = 1;
+                return parse_status(value, &c->value.status.list[0]);
+            }
+        case 5:
+        case 6:
+            return parse_double_quoted_string(value, &c->value.str);
+    }
+
+    return 0;
+}
+
+
+int cmp_int(int a, int b, Operator op) {
+    switch (op) {
+        case OP_EQ: return a == b;
+        case OP_NE: return a != b;
+        case OP_LT: return a < b;
+        case OP_LE: return a <= b;
+        case OP_GT: return a > b;
+        case OP_GE: return a >= b;
+        default: return 0;
+    }
+}
+
+
+
+
+
+
+int cmp_date(Date a, Date b, Operator op) {
+    return cmp_int(date_to_int(a), date_to_int(b), op);
+}
+
+
+// defines the six comparison evaluators of one field, lhs and rhs are compared as values
+#define DEFINE_EVALUATORS(name, lhs, rhs) \
+    int eval_##name##_eq(const Node* n, const Condition* c) { return (lhs) == (rhs); } \
+    int eval_##name##_ne(const Node* n, const Condition* c) { return (lhs) != (rhs); } \
+    int eval_##name##_lt(const Node* n, const Condition* c) { return (lhs) < (rhs); } \
+    int eval_##name##_le(const Node* n, const Condition* c) { return (lhs) <= (rhs); } \
+    int eval_##name##_gt(const Node* n, const Condition* c) { return (lhs) > (rhs); } \
+    int eval_##name##_ge(const Node* n, const Condition* c) { return (lhs) >= (rhs); }
+
+#define EVALUATOR_ROW(name) \
+    { eval_##name##_eq, eval_##name##_ne, eval_##name##_lt, eval_##name##_le, \
+      eval_##name##_gt, eval_##name##_ge, eval_false, eval_false }
+
+DEFINE_EVALUATORS(unit_id, n->unit_id, c->arg.i)
+DEFINE_EVALUATORS(unit_model, strcmp(n->unit_model, c->value.str), 0)
+DEFINE_EVALUATORS(carnum, n->car_key, c->arg.key)
+DEFINE_EVALUATORS(chk_date, date_to_int(n->chk_date), c->arg.i)
+DEFINE_EVALUATORS(status, (int)n->status, c->arg.i)
+DEFINE_EVALUATORS(mechanic, strcmp(n->mechanic, c->value.str), 0)
+DEFINE_EVALUATORS(driver, strcmp(n->driver, c->value.str), 0)
+
+// /in/ and /not_in/ only make sense for the status, for other fields they never match
+int eval_false(const Node* n, const Condition* c) {
+    (void)n;
+    (void)c;
+    return 0;
+}
+
+int eval_status_in(const Node* n, const Condition* c) {
+    return (c->arg.mask >> n->status) & 1;
+}
+
+int eval_status_not_in(const Node* n, const Condition* c) {
+    return !((c->arg.mask >> n->status) & 1);
+}
+
+CondFn condition_evaluators[FIELD_COUNT][OP_NOT_IN + 1] = {
+    EVALUATOR_ROW(unit_id),
+    EVALUATOR_ROW(unit_model),
+    EVALUATOR_ROW(carnum),
+    EVALUATOR_ROW(chk_date),
+    { eval_status_eq, eval_status_ne, eval_status_lt, eval_status_le,
+      eval_status_gt, eval_status_ge, eval_status_in, eval_status_not_in },
+    EVALUATOR_ROW(mechanic),
+    EVALUATOR_ROW(driver)
+};
+
+// decodes the parsed value of a condition for its evaluator
+void bind_condition(Condition* c) {
+    switch (c->field) {
+        case 0:
+            c->arg.i = c->value.i;
+            break;
+
+        case 2:
+            c->arg.key = carnum_key(c->value.carnum);
+            break;
+
+        case 3:
+            c->arg.i = date_to_int(c->value.date);
+            break;
+
+        case 4:
+            if (c->op == OP_IN || c->op == OP_NOT_IN) {
+                c->arg.mask = 0;
+                for (int i = 0; i < c->value.status.count; i++)
+                    c->arg.mask |= 1u << c->value.status.list[i];
+            } else {
+                c->arg.i = c->value.status.count ? (int)c->value.status.list[0] : -1;
+            }
+            break;
+    }
+}
+
+// picks the evaluator of a parsed condition and decodes its value for it
+void compile_condition(Condition* c) {
+    c->eval = condition_evaluators[c->field][c->op];
+    bind_condition(c);
+}
+
+int parse_conditions(char* cond_str, Condition** conds, int* count) {
+    *conds = NULL;
+    *count = 0;
+
+    char* token;
+
+    while ((token = next_token(&cond_str, ' '))) {
+        Condition* tmp = (Condition*)db_realloc(*conds, (*count + 1) * sizeof(Condition));
+        if (!tmp)
+            return 0;
+
+        *conds = tmp;
+
+        Condition* c = &(*conds)[*count];
+
+        char* field = token;
+
+        while (*token && !strchr("=!<>/", *token))
+            token++;
+
+        c->op = parse_operator(&token);
+        if (c->op == (Operator)-1)
+            return 0;
+
+        field = trim(field);
+
+        c->field = -1;
+
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if (strcmp(field, field_names[i]) == 0) {
+                c->field = i;
+                break;
+            }
+        }
+
+        if (c->field == -1)
+            return 0;
+
+        char* value = trim(token);
+
+        if (!parse_condition_value(c, value))
+            return 0;
+
+        compile_condition(c);
+
+        (*count)++;
+    }
+
+    return 1;
+}
+
+int check_conditions(Node* n, Condition* conds, int count) {
+    for (int i = 0; i < count; i++)
+        if (!conds[i].eval(n, &conds[i]))
+            return 0;
+
+    return 1;
+}
+
+
+// picks the rows an index narrows the conditions down to,
+// returns 0 when the whole queue has to be scanned
+int find_candidates(Queue* q, Condition* conds, int count, RowSet* set) {
+    set->rows = NULL;
+    set->count = 0;
+
+    // an index that is broken or was never built after a load is rebuilt by the first query that needs it
+    for (int i = 0; i < count; i++) {
+        if (conds[i].field == 0 && conds[i].op == OP_EQ) {
+            if (q->id_index.broken)
+                id_index_rebuild(&q->id_index, q);
+
+            return id_index_lookup(&q->id_index, conds[i].value.i, set);
+        }
+    }
+
+    // all chk_date comparisons together bound one range of the date index
+    int lo = INT_MIN;
+    int hi = INT_MAX;
+    int ranged = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (conds[i].field != 3)
+            continue;
+
+        int d = conds[i].arg.i;
+
+        switch (conds[i].op) {
+            case OP_EQ: if (d > lo) lo = d; if (d < hi) hi = d; break;
+            case OP_LT: if (d - 1 < hi) hi = d - 1; break;
+            case OP_LE: if (d < hi) hi = d; break;
+            case OP_GT: if (d + 1 > lo) lo = d + 1; break;
+            case OP_GE: if (d > lo) lo = d; break;
+            default: continue;
+        }
+
+        ranged = 1;
+    }
+
+    if (ranged && q->date_index.broken)
+        date_index_rebuild(&q->date_index, q);
+
+    // a wide range is cheaper to answer with a plain scan
+    if (ranged && date_index_range(&q->date_index, lo, hi, q->size / INDEX_SCAN_FRACTION, set))
+        return 1;
+
+    // the status conditions together allow a set of statuses, found by running each
+    // condition on every status value
+    unsigned int allowed = (1u << MAX_STATUS) - 1;
+    int statused = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (conds[i].field != 4)
+            continue;
+
+        unsigned int mask = 0;
+        Node probe;
+
+        for (int s = 0; s < MAX_STATUS; s++) {
+            probe.status = (Status)s;
+            if (conds[i].eval(&probe, &conds[i]))
+                mask |= 1u << s;
+        }
+
+        allowed &= mask;
+        statused = 1;
+    }
+
+    if (!statused)
+        return 0;
+
+    if (q->status_index.broken)
+        status_index_rebuild(&q->status_index, q);
+
+    return status_index_lookup(&q->status_index, q, allowed, q->size / STATUS_SCAN_FRACTION, set);
+}
+
+// takes tasks of the current job until none are left, called with the lock held
+void pool_work(ThreadPool* p) {
+    while (p->next < p->tasks) {
+        int task = p->next++;
+
+        pthread_mutex_unlock(&p->lock);
+        p->run(p->job, task);
+        pthread_mutex_lock(&p->lock);
+
+        if (++p->finished == p->tasks)
+            pthread_cond_broadcast(&p->done);
+    }
+}
+
+void* pool_thread(void* arg) {
+    ThreadPool* p = (ThreadPool*)arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;) {
+        while (!p->stop && p->round == seen)
+            pthread_cond_wait(&p->wake, &p->lock);
+
+        if (p->stop)
+            break;
+
+        seen = p->round;
+        pool_work(p);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// starts threads - 1 workers, a pool without workers runs every task on the calling thread
+void pool_start(ThreadPool* p, int threads) {
+    memset(p, 0, sizeof(ThreadPool));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    if (threads <= 1)
+        return;
+
+    p->threads = (pthread_t*)db_malloc((threads - 1) * sizeof(pthread_t));
+    if (!p->threads)
+        return;
+
+    while (p->count < threads - 1 && pthread_create(&p->threads[p->count], NULL, pool_thread, p) == 0)
+        p->count++;
+}
+
+// runs tasks 0..tasks-1 of the job and waits for all of them
+void pool_run(ThreadPool* p, int tasks, void (*run)(void* job, int task), void* job) {
+    pthread_mutex_lock(&p->lock);
+
+    p->run = run;
+    p->job = job;
+    p->tasks = tasks;
+    p->next = 0;
+    p->finished = 0;
+    p->round++;
+    pthread_cond_broadcast(&p->wake);
+
+    pool_work(p);
+
+    while (p->finished < p->tasks)
+        pthread_cond_wait(&p->done, &p->lock);
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_stop(ThreadPool* p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->count; i++)
+        pthread_join(p->threads[i], NULL);
+
+    db_free(p->threads);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    memset(p, 0, sizeof(ThreadPool));
+}
+
+// checks one range of rids, workers only read the rows and write their own part of hits
+void scan_range(void* arg, int task) {
+    ScanJob* job = (ScanJob*)arg;
+    uint64_t start = (uint64_t)task * job->chunk;
+    uint64_t end = start + job->chunk < job->q->next_rid ? start + job->chunk : job->q->next_rid;
+    int found = 0;
+
+    for (uint64_t rid = start; rid < end; rid++) {
+        Node* n = live_row(job->q, (unsigned int)rid);
+
+        job->hits[rid] = n && check_conditions(n, job->conds, job->count);
+        found += job->hits[rid];
+    }
+
+    job->found[task] = found;
+}
+
+// splits the rid directory into ranges checked by the thread pool, the hits are gathered in rid order
+int parallel_matches(Queue* q, Condition* conds, int count, RowSet* set) {
+    int tasks = (thread_pool.count + 1) * TASKS_PER_THREAD;
+    ScanJob job = { q, conds, count, (q->next_rid + tasks - 1) / tasks, NULL, NULL };
+
+    job.hits = (unsigned char*)db_malloc(q->next_rid);
+    job.found = (int*)db_malloc(tasks * sizeof(int));
+
+    int ok = job.hits && job.found;
+
+    if (ok) {
+        pool_run(&thread_pool, tasks, scan_range, &job);
+
+        int total = 0;
+        for (int i = 0; i < tasks; i++)
+            total += job.found[i];
+
+        if (total > 0) {
+            set->rows = (Node**)db_malloc(total * sizeof(Node*));
+            ok = set->rows != NULL;
+        }
+
+        for (unsigned int rid = 0; ok && set->count < total; rid++)
+            if (job.hits[rid])
+                set->rows[set->count++] = q->rows[rid];
+    }
+
+    db_free(job.hits);
+    db_free(job.found);
+    return ok;
+}
+
+int parse_sort_keys(char* str, SortKey** keys, int* count)
+{
+    *keys = NULL;
+    *count = 0;
+
+    char* token;
+
+    while ((token = next_token(&str, ','))) {
+
+        char* eq = strchr(token, '=');
+        if (!eq) return 0;
+
+        *eq = '\0';
+
+        char* field = trim(token);
+        char* ord = trim(eq + 1);
+
+        int f = -1;
+
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if (strcmp(field, field_names[i]) == 0) {
+                f = i;
+                break;
+            }
+        }
+
+        if (f == -1)
+            return 0;
+
+        if (f == 4)
+            return 0;
+
+        for (int i = 0; i < *count; i++)
+            if ((*keys)[i].field == f)
+                return 0;
+
+        SortKey* tmp = (SortKey*)db_realloc(*keys, (*count + 1) * sizeof(SortKey));
+
+        if (!tmp) return 0;
+
+        *keys = tmp;
+
+        (*keys)[*count].field = f;
+        if (!strcmp(ord, "asc")) (*keys)[*count].order = ORDER_ASC;
+        else if (!strcmp(ord, "desc")) (*keys)[*count].order = ORDER_DESC;
+        else return 0;
+
+        (*count)++;
+    }
+
+    return *count > 0;
+}
+
+int compare_nodes(Node* a, Node* b, SortKey* keys, int n) {
+    for (int i = 0; i < n; i++) {
+
+        int cmp = 0;
+
+        switch (keys[i].field) {
+
+        case 0:
+            cmp = (a->unit_id > b->unit_id) - (a->unit_id < b->unit_id);
+            break;
+
+        case 1:
+            cmp = strcmp(a->unit_model, b->unit_model);
+            break;
+
+        case 2:
+            cmp = (a->car_key > b->car_key) - (a->car_key < b->car_key);
+            break;
+
+        case 3:
+            cmp = cmp_date(a->chk_date, b->chk_date, OP_GT) - cmp_date(a->chk_date, b->chk_date, OP_LT);
+            break;
+
+        case 5:
+            cmp = strcmp(a->mechanic, b->mechanic);
+            break;
+
+        case 6:
+            cmp = strcmp(a->driver, b->driver);
+            break;
+        }
+
+        if (cmp != 0) {
+
+            if (keys[i].order == ORDER_DESC)
+                cmp = -cmp;
+
+            return cmp;
+        }
+    }
+
+    return 0;
+}
+
+// rows that satisfy all conditions in queue order, returns 0 if out of memory
+int collect_matches(Queue* q, Condition* conds, int count, RowSet* set) {
+    if (find_candidates(q, conds, count, set)) {
+        int kept = 0;
+
+        for (int i = 0; i < set->count; i++)
+            if (check_conditions(set->rows[i], conds, count))
+                set->rows[kept++] = set->rows[i];
+
+        rows_scanned += set->count;
+        rows_matched += kept;
+
+        set->count = kept;
+        return 1;
+    }
+
+    rows_scanned += q->size;
+
+    if (thread_pool.count > 0 && q->next_rid >= PARALLEL_MIN_ROWS) {
+        if (!parallel_matches(q, conds, count, set))
+            return 0;
+
+        rows_matched += set->count;
+        return 1;
+    }
+
+    int cap = 0;
+
+    for (Node* cur = q->head; cur; cur = cur->next) {
+        if (!check_conditions(cur, conds, count))
+            continue;
+
+        if (!rowset_push(set, &cap, cur)) {
+            free_rowset(set);
+            return 0;
+        }
+    }
+
+    rows_matched += set->count;
+    return 1;
+}
+
+// prints the selected fields of one row
+void print_row(Writer* output, Node* row, int* fields, int field_count) {
+    for (int i = 0; i < field_count; i++) {
+        print_field(output, row, fields[i]);
+
+        if (i + 1 < field_count)
+            writer_putc(output, ' ');
+    }
+
+    writer_putc(output, '\n');
+}
+
+// prints the count and the selected fields of the rows
+void print_rows(Writer* output, RowSet* matches, int* fields, int field_count) {
+    writer_write(output, "select:", 7);
+    writer_int(output, matches->count);
+    writer_putc(output, '\n');
+
+    for (int j = 0; j < matches->count; j++)
+        print_row(output, matches->rows[j], fields, field_count);
+}
+
+// orders rows by the keys and rows with equal keys by their place in the queue, as sort does
+int top_compare(const SelectOrder* o, const TopEntry* a, const TopEntry* b) {
+    int cmp = compare_nodes(a->row, b->row, o->keys, o->key_count);
+    if (cmp != 0)
+        return cmp;
+
+    return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+void top_swap(TopEntry* a, TopEntry* b) {
+    TopEntry tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+void top_sift_down(TopRows* t, int i, int count) {
+    TopEntry* h = t->items;
+
+    for (;;) {
+        int largest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < count && top_compare(t->order, &h[left], &h[largest]) > 0)
+            largest = left;
+        if (right < count && top_compare(t->order, &h[right], &h[largest]) > 0)
+            largest = right;
+
+        if (largest == i)
+            return;
+
+        top_swap(&h[i], &h[largest]);
+        i = largest;
+    }
+}
+
+void top_sift_up(TopRows* t, int i) {
+    TopEntry* h = t->items;
+
+    while (i > 0 && top_compare(t->order, &h[i], &h[(i - 1) / 2]) > 0) {
+        top_swap(&h[i], &h[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+}
+
+// offers the next matching row in queue order, returns 0 if out of memory
+int top_push(TopRows* t, Node* n) {
+    const SelectOrder* o = t->order;
+    TopEntry e = { n, t->seen++ };
+
+    if (t->count == o->limit) {
+        // a row that ties with the root came later in the queue, so it stays out
+        if (o->key_count == 0 || t->count == 0 || compare_nodes(n, t->items[0].row, o->keys, o->key_count) >= 0)
+            return 1;
+
+        t->items[0] = e;
+        top_sift_down(t, 0, t->count);
+        return 1;
+    }
+
+    if (t->count == t->cap) {
+        int cap = t->cap ? t->cap * 2 : 16;
+        if (o->limit >= 0 && cap > o->limit)
+            cap = o->limit;
+
+        TopEntry* tmp = (TopEntry*)db_realloc(t->items, cap * sizeof(TopEntry));
+        if (!tmp)
+            return 0;
+
+        t->items = tmp;
+        t->cap = cap;
+    }
+
+    t->items[t->count++] = e;
+
+    if (o->key_count > 0)
+        top_sift_up(t, t->count - 1);
+    return 1;
+}
+
+// without order by the scan can stop at the limit
+int top_full(TopRows* t) {
+    return t->order->key_count == 0 && t->count == t->order->limit;
+}
+
+// prints the kept rows in order, the heap is sorted in place
+void print_top(Writer* output, TopRows* t, int* fields, int field_count) {
+    if (t->order->key_count > 0) {
+        for (int end = t->count - 1; end > 0; end--) {
+            top_swap(&t->items[0], &t->items[end]);
+            top_sift_down(t, 0, end);
+        }
+    }
+
+    writer_write(output, "select:", 7);
+    writer_int(output, t->count);
+    writer_putc(output, '\n');
+
+    for (int i = 0; i < t->count; i++)
+        print_row(output, t->items[i].row, fields, field_count);
+}
+
+// visits the rows that satisfy all conditions in queue order: the index candidates if an index
+// narrows the conditions down, otherwise the list, so no set of all matching rows is built.
+// visit returns 1 to go on, 0 to stop or -1 if out of memory; returns 0 if out of memory
+int scan_matches(Queue* q, Condition* conds, int count, int (*visit)(void*, Node*), void* arg) {
+    RowSet set;
+    int step = 1;
+
+    if (find_candidates(q, conds, count, &set)) {
+        for (int i = 0; step > 0 && i < set.count; i++) {
+            rows_scanned++;
+
+            if (check_conditions(set.rows[i], conds, count)) {
+                rows_matched++;
+                step = visit(arg, set.rows[i]);
+            }
+        }
+
+        free_rowset(&set);
+        return step >= 0;
+    }
+
+    for (Node* cur = q->head; step > 0 && cur; cur = cur->next) {
+        rows_scanned++;
+
+        if (check_conditions(cur, conds, count)) {
+            rows_matched++;
+            step = visit(arg, cur);
+        }
+    }
+
+    return step >= 0;
+}
+
+int top_visit(void* arg, Node* n) {
+    TopRows* t = (TopRows*)arg;
+
+    if (!top_push(t, n))
+        return -1;
+
+    return !top_full(t);
+}
+
+// prints the rows that match the parsed conditions, order is NULL or the order by and limit
+// of the select; returns -1 if out of memory
+int run_select(Writer* output, Queue* queue, int* fields, int field_count, Condition* conds, int cond_count,
+    const SelectOrder* order) {
+    if (order && (order->key_count > 0 || order->limit >= 0)) {
+        TopRows top = { order, NULL, 0, 0, 0 };
+
+        // limit 0 prints no rows, there is nothing to look for
+        if (order->limit != 0 && !scan_matches(queue, conds, cond_count, top_visit, &top)) {
+            db_free(top.items);
+            return -1;
+        }
+
+        print_top(output, &top, fields, field_count);
+        db_free(top.items);
+        return 0;
+    }
+
+    RowSet matches;
+    if (!collect_matches(queue, conds, cond_count, &matches))
+        return -1;
+
+    print_rows(output, &matches, fields, field_count);
+
+    free_rowset(&matches);
+    return 0;
+}
+
+// start of the first clause that begins with one of the words (a NULL terminated list) after a space,
+// outside quoted values; NULL if there is none
+char* find_clause(char* s, const char* const* words) {
+    int in_quotes = 0;
+
+    for (char* p = s; *p; p++) {
+        if (*p == '\"') {
+            in_quotes = !in_quotes;
+            continue;
+        }
+
+        if (in_quotes || *p != ' ')
+            continue;
+
+        for (int i = 0; words[i]; i++)
+            if (strncmp(p + 1, words[i], strlen(words[i])) == 0)
+                return p + 1;
+    }
+
+    return NULL;
+}
+
+const char* const select_clauses[] = { "order by ", "limit ", NULL };
+
+// parses "order by <sort keys>", "limit <n>" or both in that order, returns 0 if they are incorrect
+int parse_select_order(char* clause, SelectOrder* order) {
+    char* limit = clause;
+
+    if (strncmp(clause, "order by ", 9) == 0) {
+        char* keys = clause + 9;
+
+        limit = strstr(keys, " limit ");
+        if (limit)
+            *limit++ = '\0';
+
+        if (!parse_sort_keys(trim(keys), &order->keys, &order->key_count))
+            return 0;
+
+        if (!limit)
+            return 1;
+    }
+
+    if (strncmp(limit, "limit ", 6) != 0)
+        return 0;
+
+    return parse_int(trim(limit + 6), &order->limit) && order->limit >= 0;
+}
+
+// splits the arguments of a select into the field list, the conditions and the order by and limit clause,
+// returns 0 if they are incorrect
+int parse_select(char* line, int** fields, int* field_count, Condition** conds, int* cond_count, SelectOrder* order) {
+    char* args = line + 6;
+    args = trim(args);
+
+    order->keys = NULL;
+    order->key_count = 0;
+    order->limit = -1;
+
+    char* clause = find_clause(args, select_clauses);
+    if (clause) {
+        clause[-1] = '\0';
+        if (!parse_select_order(clause, order))
+            return 0;
+        args = trim(args);
+    }
+
+    char* cond = strchr(args, ' ');
+
+    if (*args == '\0')
+        return 0;
+
+    if (cond) {
+        *cond++ = '\0';
+        cond = trim(cond);
+        if (!parse_conditions(cond, conds, cond_count))
+            return 0;
+    }
+
+    return parse_field_list(args, fields, field_count);
+}
+
+int select_db(char* line, Writer* output, Queue* queue) {
+    int* fields = NULL;
+    int field_count;
+
+    Condition* conds = NULL;
+    int cond_count = 0;
+
+    SelectOrder order;
+
+    if (!parse_select(line, &fields, &field_count, &conds, &cond_count, &order)) goto error;
+
+    if (run_select(output, queue, fields, field_count, conds, cond_count, &order) < 0) goto error;
+
+    db_free(fields);
+    db_free(conds);
+    db_free(order.keys);
+    return 0;
+
+error:
+    writer_printf(output, "incorrect:'%.20s'\n", line);
+    db_free(fields);
+    db_free(conds);
+    db_free(order.keys);
+    return -1;
+}
+
+// select on a snapshot, run by a reader thread: the indexes and the thread pool belong to the writer,
+// so the reader checks every row of the snapshot
+void snapshot_select(char* line, Writer* output, const Snapshot* snap, uint64_t* scanned, uint64_t* matched) {
+    int* fields = NULL;
+    int field_count;
+
+    Condition* conds = NULL;
+    int cond_count = 0;
+
+    RowSet matches = { NULL, 0 };
+    int cap = 0;
+
+    SelectOrder order;
+    TopRows top = { &order, NULL, 0, 0, 0 };
+
+    if (!parse_select(line, &fields, &field_count, &conds, &cond_count, &order)) goto error;
+
+    // rids follow the queue order, so the rows reach the heap in the same order as in scan_matches
+    int ranked = order.key_count > 0 || order.limit >= 0;
+
+    for (unsigned int rid = 0; rid < snap->count && !(ranked && top_full(&top)); rid++) {
+        Node* n = snapshot_row(snap, rid);
+        if (!n)
+            continue;
+
+        (*scanned)++;
+
+        if (!check_conditions(n, conds, cond_count))
+            continue;
+
+        (*matched)++;
+
+        if (ranked ? !top_push(&top, n) : !rowset_push(&matches, &cap, n))
+            goto error;
+    }
+
+    if (ranked)
+        print_top(output, &top, fields, field_count);
+    else
+        print_rows(output, &matches, fields, field_count);
+
+    free_rowset(&matches);
+    db_free(top.items);
+    db_free(fields);
+    db_free(conds);
+    db_free(order.keys);
+    return;
+
+error:
+    writer_printf(output, "incorrect:'%.20s'\n", line);
+    free_rowset(&matches);
+    db_free(top.items);
+    db_free(fields);
+    db_free(conds);
+    db_free(order.keys);
+}
+
+// removes the rows that match the parsed conditions, returns how many or -1 if out of memory
+int run_delete(Writer* output, Queue* queue, Condition* conds, int cond_count) {
+    RowSet matches;
+    if (!collect_matches(queue, conds, cond_count, &matches))
+        return -1;
+
+    if (queue->versions.snapshots && !reserve_retired(&queue->versions, matches.count)) {
+        free_rowset(&matches);
+        return -1;
+    }
+
+    int deleted = 0;
+
+    for (; deleted < matches.count; deleted++) {
+        unlink_node(queue, matches.rows[deleted]);
+        drop_node(queue, matches.rows[deleted]);
+    }
+
+    free_rowset(&matches);
+    compact_rows(queue);
+
+    queue->size -= deleted;
+    writer_printf(output, "delete:%d\n", deleted);
+    return deleted;
+}
+
+// takes the conditions out of a delete, returns 0 if they are incorrect
+int parse_delete(char* line, Condition** conds, int* cond_count) {
+    char* args = line + 6;
+
+    if (*args == '\0')
+        return 0;
+
+    args = trim(args);
+
+    return parse_conditions(args, conds, cond_count);
+}
+
+int delete_db(char* line, Writer* output, Queue* queue) {
+    Condition* conds = NULL;
+    int cond_count = 0;
+
+    int deleted;
+
+    if (!parse_delete(line, &conds, &cond_count))
+        goto error;
+
+    deleted = run_delete(output, queue, conds, cond_count);
+    if (deleted < 0)
+        goto error;
+
+    db_free(conds);
+    return deleted;
+
+error:
+    writer_printf(output, "incorrect:'%.20s'\n", line);
+    db_free(conds);
+    return -1;
+}
+
+// parses the value of one update the way a condition value is parsed
+int parse_update_value(Update* u, char* value) {
+    Condition fake;
+    fake.field = u->field;
+
+    if (!parse_condition_value(&fake, value))
+        return 0;
+
+    memcpy(&u->value, &fake.value, sizeof(u->value));
+
+    if (u->field == 2)
+        u->car_key = carnum_key(u->value.carnum);
+
+    return 1;
+}
+
+int parse_updates(char* str, Update** upds, int* count) {
+    *upds = NULL;
+    *count = 0;
+
+    char* token;
+
+    while ((token = next_token(&str, ','))) {
+        token = trim(token);
+
+        char* eq = strchr(token, '=');
+        if (!eq) return 0;
+
+        *eq = '\0';
+
+        char* field = trim(token);
+        char* value = trim(eq + 1);
+
+        int id = -1;
+        for (int i = 0; i < FIELD_COUNT; i++)
+            if (!strcmp(field, field_names[i])) {
+                id = i;
+                break;
+            }
+
+        if (id == -1) return 0;
+
+        Update* tmp = (Update*)db_realloc(*upds, (*count + 1) * sizeof(Update));
+
+        if (!tmp) return 0;
+
+        *upds = tmp;
+
+        Update* u = &(*upds)[*count];
+        u->field = id;
+
+        if (!parse_update_value(u, value))
+            return 0;
+
+        (*count)++;
+    }
+
+    return *count > 0;
+}
+
+// drops the references of the updates, a copy no row took is freed again
+void release_update_strings(StringArena* arena, Update* upds, int count) {
+    for (int i = 0; i < count; i++) {
+        switch (upds[i].field) {
+
+            case 1:
+            case 5:
+            case 6:
+                arena_release(arena, upds[i].value.str);
+                break;
+
+            case 2:
+                arena_release(arena, upds[i].value.carnum);
+                break;
+        }
+    }
+}
+
+// moves the string values of the updates into the arena, so all updated rows share one copy;
+// the updates hold one reference to each copy until release_update_strings
+int store_update_strings(StringArena* arena, Update* upds, int count) {
+    for (int i = 0; i < count; i++) {
+        const char* copy = NULL;
+
+        switch (upds[i].field) {
+
+            case 1:
+            case 5:
+            case 6:
+                copy = upds[i].value.str = arena_strdup(arena, upds[i].value.str);
+                break;
+
+            case 2:
+                copy = upds[i].value.carnum = arena_strdup(arena, upds[i].value.carnum);
+                break;
+
+            default:
+                continue;
+        }
+
+        // the copies made so far are released, the others still point into the command
+        if (!copy) {
+            release_update_strings(arena, upds, i);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// points a string field of a row at a new value, the new value is held before the old one is released
+void set_row_string(StringArena* arena, const char** field, const char* value) {
+    arena_hold(arena, value);
+    arena_release(arena, *field);
+    *field = value;
+}
+
+void apply_update(StringArena* arena, Node* n, Update* upds, int count) {
+    for (int i = 0; i < count; i++) {
+        switch (upds[i].field) {
+
+            case 0:
+                n->unit_id = upds[i].value.i;
+                break;
+
+            case 1:
+                set_row_string(arena, &n->unit_model, upds[i].value.str);
+                break;
+
+            case 2:
+                set_row_string(arena, &n->carnum, upds[i].value.carnum);
+                n->car_key = upds[i].car_key;
+                break;
+
+            case 3:
+                n->chk_date = upds[i].value.date;
+                break;
+
+            case 4:
+                n->status = upds[i].value.status;
+                break;
+
+            case 5:
+                set_row_string(arena, &n->mechanic, upds[i].value.str);
+                break;
+
+            case 6:
+                set_row_string(arena, &n->driver, upds[i].value.str);
+                break;
+        }
+    }
+}
+
+// applies the parsed updates to the rows that match the parsed conditions,
+// returns how many or -1 if out of memory
+int run_update(Writer* out, Queue* q, Update* upds, int upd_count, Condition* conds, int cond_count) {
+    int reindex = 0;
+    for (int i = 0; i < upd_count; i++)
+        reindex |= (1 << upds[i].field) & INDEXED_FIELDS;
+
+    RowSet matches;
+    if (!collect_matches(q, conds, cond_count, &matches))
+        return -1;
+
+    // while snapshots are open every row is changed in a new version, taken before anything changes
+    Node** versions = NULL;
+    int ready = 0;
+    int ok = 1;
+
+    if (q->versions.snapshots && matches.count > 0) {
+        versions = (Node**)db_malloc(matches.count * sizeof(Node*));
+        ok = versions && reserve_retired(&q->versions, matches.count);
+
+        while (ok && ready < matches.count && (versions[ready] = alloc_node(&q->pool)) != NULL)
+            ready++;
+
+        ok = ok && ready == matches.count;
+    }
+
+    // the string values are only copied into the arena when a row takes them
+    if (ok && matches.count > 0)
+        ok = store_update_strings(&q->strings, upds, upd_count);
+
+    if (!ok) {
+        while (ready > 0)
+            release_node(&q->pool, versions[--ready]);
+        db_free(versions);
+        free_rowset(&matches);
+        return -1;
+    }
+
+    int updated = 0;
+
+    for (; updated < matches.count; updated++) {
+        Node* cur = matches.rows[updated];
+
+        if (versions)
+            cur = new_version(q, cur, versions[updated]);
+
+        if (reindex)
+            unindex_node(q, cur, reindex);
+
+        apply_update(&q->strings, cur, upds, upd_count);
+
+        if (reindex)
+            index_node(q, cur, reindex);
+    }
+
+    if (matches.count > 0)
+        release_update_strings(&q->strings, upds, upd_count);
+
+    db_free(versions);
+    free_rowset(&matches);
+
+    writer_printf(out, "update:%d\n", updated);
+    return updated;
+}
+
+// splits an update into the new values and the conditions, returns 0 if they are incorrect
+int parse_update(char* line, Update** upds, int* upd_count, Condition** conds, int* cond_count) {
+    char* args = trim(line + 6);
+    char* cond = strchr(args, ' ');
+
+    if (*args == '\0')
+        return 0;
+
+    if (cond) {
+        *cond++ = '\0';
+        cond = trim(cond);
+        if (!parse_conditions(cond, conds, cond_count))
+            return 0;
+    }
+
+    return parse_updates(args, upds, upd_count);
+}
+
+int update_db(char* line, Writer* out, Queue* q) {
+    Update* upds = NULL;
+    int upd_count = 0;
+
+    Condition* conds = NULL;
+    int cond_count = 0;
+
+    int updated;
+
+    if (!parse_update(line, &upds, &upd_count, &conds, &cond_count))
+        goto error;
+
+    updated = run_update(out, q, upds, upd_count, conds, cond_count);
+    if (updated < 0)
+        goto error;
+
+    db_free(upds);
+    db_free(conds);
+    return updated;
+
+error:
+    writer_printf(out, "incorrect:'%.20s'\n", line);
+    db_free(upds);
+    db_free(conds);
+    return -1;
+}
+
+
+int nodes_equal(Node* a, Node* b, int* fields, int count) {
+    for (int i = 0; i < count; i++) {
+        switch (fields[i]) {
+
+        case 0:
+            if (a->unit_id != b->unit_id) return 0;
+            break;
+
+        case 1:
+            if (strcmp(a->unit_model, b->unit_model)) return 0;
+            break;
+
+        case 2:
+            if (a->car_key != b->car_key) return 0;
+            break;
+
+        case 3:
+            if (memcmp(&a->chk_date, &b->chk_date, sizeof(Date)))
+                return 0;
+            break;
+
+        case 4:
+            if (a->status != b->status) return 0;
+            break;
+
+        case 5:
+            if (strcmp(a->mechanic, b->mechanic)) return 0;
+            break;
+        case 6:
+            if (strcmp(a->driver, b->driver)) return 0;
+            break;
+        }
+    }
+
+    return 1;
+}
+
+
+// FNV-1a hash of a block of bytes
+uint64_t hash_bytes(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+
+// hash of the selected fields, equal for rows that nodes_equal treats as equal
+uint64_t hash_node(Node* n, int* fields, int count) {
+    uint64_t h = FNV_OFFSET;
+
+    for (int i = 0; i < count; i++) {
+        switch (fields[i]) {
+
+        case 0:
+            h = hash_bytes(h, &n->unit_id, sizeof(n->unit_id));
+            break;
+
+        case 1:
+            h = hash_bytes(h, n->unit_model, strlen(n->unit_model));
+            break;
+
+        case 2:
+            h = hash_bytes(h, &n->car_key, sizeof(n->car_key));
+            break;
+
+        case 3:
+            h = hash_bytes(h, &n->chk_date, sizeof(Date));
+            break;
+
+        case 4:
+            h = hash_bytes(h, &n->status, sizeof(n->status));
+            break;
+
+        case 5:
+            h = hash_bytes(h, n->mechanic, strlen(n->mechanic));
+            break;
+
+        case 6:
+            h = hash_bytes(h, n->driver, strlen(n->driver));
+            break;
+        }
+
+        h = hash_bytes(h, &fields[i], sizeof(fields[i]));
+    }
+
+    return h;
+}
+
+int uniq_db(char* args, Writer* out, Queue* q) {
+    args = trim(args + 4);
+
+    int* fields = NULL;
+    int field_count;
+
+    UniqSlot* table = NULL;
+    size_t table_size = 16;
+
+    int* slot_of = NULL;
+
+    int removed = 0;
+
+    if (!parse_field_list(args, &fields, &field_count)) goto error;
+
+    if (q->head) {
+        // queue->size is an upper bound of the real length of the list
+        while (table_size < (size_t)q->size * 2)
+            table_size *= 2;
+
+        table = (UniqSlot*)db_malloc(table_size * sizeof(UniqSlot));
+        if (!table) goto error;
+        memset(table, 0, table_size * sizeof(UniqSlot));
+
+        slot_of = (int*)db_malloc((size_t)q->size * sizeof(int));
+        if (!slot_of) goto error;
+
+        if (q->versions.snapshots && !reserve_retired(&q->versions, (size_t)q->size)) goto error;
+
+        // first pass: group equal rows and count how many times each group occurs
+        int i = 0;
+        for (Node* cur = q->head; cur; cur = cur->next, i++) {
+            uint64_t h = hash_node(cur, fields, field_count);
+            size_t idx = (size_t)h & (table_size - 1);
+
+            while (table[idx].node) {
+                if (table[idx].hash == h && nodes_equal(cur, table[idx].node, fields, field_count))
+                    break;
+                idx = (idx + 1) & (table_size - 1);
+            }
+
+            if (!table[idx].node) {
+                table[idx].node = cur;
+                table[idx].hash = h;
+            }
+
+            table[idx].count++;
+            slot_of[i] = (int)idx;
+        }
+
+        // second pass: a row is a duplicate if its group still occurs later in the list
+        Node* cur = q->head;
+        i = 0;
+
+        while (cur) {
+            Node* next = cur->next;
+
+            if (--table[slot_of[i++]].count > 0) {
+                unlink_node(q, cur);
+                drop_node(q, cur);
+                removed++;
+            }
+
+            cur = next;
+        }
+
+        compact_rows(q);
+    }
+
+    db_free(table);
+    db_free(slot_of);
+    db_free(fields);
+
+    writer_printf(out, "uniq:%d\n", removed);
+    return removed;
+
+error:
+    writer_printf(out, "incorrect:'%.20s'\n", args);
+    db_free(table);
+    db_free(slot_of);
+    db_free(fields);
+    return -1;
+}
+
+// parses the comma separated items of an aggregate: count, min(<field>) or max(<field>),
+// status has no order and cannot be used with min and max; returns 0 if they are incorrect
+int parse_aggregate_items(char* str, AggregateItem** items, int* count) {
+    *items = NULL;
+    *count = 0;
+
+    char* token;
+
+    while ((token = next_token(&str, ','))) {
+        token = trim(token);
+
+        AggregateItem item = { 'c', -1 };
+
+        if (strncmp(token, "min(", 4) == 0 || strncmp(token, "max(", 4) == 0) {
+            item.kind = token[1] == 'i' ? '<' : '>';
+
+            char* end = strchr(token, ')');
+            if (!end || end[1] != '\0')
+                return 0;
+            *end = '\0';
+
+            char* field = trim(token + 4);
+            for (int i = 0; i < FIELD_COUNT; i++)
+                if (strcmp(field, field_names[i]) == 0)
+                    item.field = i;
+
+            if (item.field == -1 || item.field == 4)
+                return 0;
+        } else if (strcmp(token, "count") != 0) {
+            return 0;
+        }
+
+        AggregateItem* tmp = (AggregateItem*)db_realloc(*items, (*count + 1) * sizeof(AggregateItem));
+        if (!tmp)
+            return 0;
+
+        *items = tmp;
+        (*items)[(*count)++] = item;
+    }
+
+    return *count > 0;
+}
+
+// adds a group whose first row is key, returns its number or -1 if out of memory
+int aggregate_add_group(Aggregate* a, Node* key, uint64_t hash) {
+    if (a->group_count == a->group_cap) {
+        int cap = a->group_cap ? a->group_cap * 2 : 16;
+
+        Node** keys = (Node**)db_realloc(a->keys, cap * sizeof(Node*));
+        if (!keys)
+            return -1;
+        a->keys = keys;
+
+        uint64_t* hashes = (uint64_t*)db_realloc(a->hashes, cap * sizeof(uint64_t));
+        if (!hashes)
+            return -1;
+        a->hashes = hashes;
+
+        int* counts = (int*)db_realloc(a->counts, cap * sizeof(int));
+        if (!counts)
+            return -1;
+        a->counts = counts;
+
+        Node** extremes = (Node**)db_realloc(a->extremes, (size_t)cap * a->item_count * sizeof(Node*));
+        if (!extremes)
+            return -1;
+        a->extremes = extremes;
+
+        a->group_cap = cap;
+    }
+
+    int g = a->group_count++;
+    a->keys[g] = key;
+    a->hashes[g] = hash;
+    a->counts[g] = 0;
+
+    for (int i = 0; i < a->item_count; i++)
+        a->extremes[(size_t)g * a->item_count + i] = NULL;
+
+    return g;
+}
+
+// group of a row, a new one if the row is the first of its group; -1 if out of memory
+int aggregate_group(Aggregate* a, Node* n) {
+    if (a->group_field < 0)
+        return 0;
+
+    // a status has five values, its groups are looked up directly
+    if (a->group_field == 4 && (unsigned int)n->status < MAX_STATUS) {
+        if (a->status_groups[n->status] < 0)
+            a->status_groups[n->status] = aggregate_add_group(a, n, 0);
+        return a->status_groups[n->status];
+    }
+
+    uint64_t h = hash_node(n, &a->group_field, 1);
+    size_t mask = a->table_size - 1;
+    size_t idx = (size_t)h & mask;
+
+    while (a->table[idx]) {
+        int g = a->table[idx] - 1;
+        if (a->hashes[g] == h && nodes_equal(n, a->keys[g], &a->group_field, 1))
+            return g;
+        idx = (idx + 1) & mask;
+    }
+
+    int g = aggregate_add_group(a, n, h);
+    if (g < 0)
+        return -1;
+
+    a->table[idx] = g + 1;
+
+    // the table is kept at most half full
+    if ((size_t)a->group_count * 2 > a->table_size) {
+        size_t size = a->table_size * 2;
+
+        int* table = (int*)db_malloc(size * sizeof(int));
+        if (!table)
+            return -1;
+        memset(table, 0, size * sizeof(int));
+
+        for (int i = 0; i < a->group_count; i++) {
+            size_t j = (size_t)a->hashes[i] & (size - 1);
+            while (table[j])
+                j = (j + 1) & (size - 1);
+            table[j] = i + 1;
+        }
+
+        db_free(a->table);
+        a->table = table;
+        a->table_size = size;
+    }
+
+    return g;
+}
+
+// adds a matching row to its group, the first row with the smallest or largest value is kept
+int aggregate_visit(void* arg, Node* n) {
+    Aggregate* a = (Aggregate*)arg;
+
+    int g = aggregate_group(a, n);
+    if (g < 0)
+        return -1;
+
+    a->counts[g]++;
+
+    Node** extremes = &a->extremes[(size_t)g * a->item_count];
+
+    for (int i = 0; i < a->item_count; i++) {
+        AggregateItem* item = &a->items[i];
+        if (item->kind == 'c')
+            continue;
+
+        SortKey key = { item->field, ORDER_ASC };
+
+        if (!extremes[i]) {
+            extremes[i] = n;
+            continue;
+        }
+
+        int cmp = compare_nodes(n, extremes[i], &key, 1);
+        if (item->kind == '<' ? cmp < 0 : cmp > 0)
+            extremes[i] = n;
+    }
+
+    return 1;
+}
+
+void print_aggregate(Writer* out, Aggregate* a) {
+    writer_write(out, "aggregate:", 10);
+    writer_int(out, a->group_count);
+    writer_putc(out, '\n');
+
+    for (int g = 0; g < a->group_count; g++) {
+        if (a->group_field >= 0) {
+            print_field(out, a->keys[g], a->group_field);
+            writer_putc(out, ' ');
+        }
+
+        for (int i = 0; i < a->item_count; i++) {
+            AggregateItem* item = &a->items[i];
+            Node* row = a->extremes[(size_t)g * a->item_count + i];
+
+            if (item->kind == 'c') {
+                writer_write(out, "count:", 6);
+                writer_int(out, a->counts[g]);
+            } else {
+                writer_write(out, item->kind == '<' ? "min:" : "max:", 4);
+                if (row)
+                    print_field(out, row, item->field);
+                else
+                    writer_write(out, "none", 4);
+            }
+
+            if (i + 1 < a->item_count)
+                writer_putc(out, ' ');
+        }
+
+        writer_putc(out, '\n');
+    }
+}
+
+void free_aggregate(Aggregate* a) {
+    db_free(a->items);
+    db_free(a->keys);
+    db_free(a->hashes);
+    db_free(a->counts);
+    db_free(a->extremes);
+    db_free(a->table);
+}
+
+const char* const aggregate_clauses[] = { "group by ", NULL };
+
+// aggregate <items> [conditions] [group by <field>]: counts the matching rows and finds the min and max
+// of fields in one scan, without printing the rows; groups are listed in order of their first row
+int aggregate_db(char* line, Writer* out, Queue* q) {
+    Aggregate a;
+    memset(&a, 0, sizeof(Aggregate));
+    a.group_field = -1;
+
+    for (int i = 0; i < MAX_STATUS; i++)
+        a.status_groups[i] = -1;
+
+    Condition* conds = NULL;
+    int cond_count = 0;
+
+    char* args = trim(line + 9);
+
+    if (*args == '\0') goto error;
+
+    char* clause = find_clause(args, aggregate_clauses);
+    if (clause) {
+        clause[-1] = '\0';
+        args = trim(args);
+
+        char* field = trim(clause + 9);
+        for (int i = 0; i < FIELD_COUNT; i++)
+            if (strcmp(field, field_names[i]) == 0)
+                a.group_field = i;
+
+        if (a.group_field == -1) goto error;
+    }
+
+    char* cond = strchr(args, ' ');
+    if (cond) {
+        *cond++ = '\0';
+        if (!parse_conditions(trim(cond), &conds, &cond_count)) goto error;
+    }
+
+    if (!parse_aggregate_items(args, &a.items, &a.item_count)) goto error;
+
+    if (a.group_field < 0) {
+        // without group by there is one line even if no row matches
+        if (aggregate_add_group(&a, NULL, 0) < 0) goto error;
+    } else {
+        a.table_size = 16;
+        a.table = (int*)db_malloc(a.table_size * sizeof(int));
+        if (!a.table) goto error;
+        memset(a.table, 0, a.table_size * sizeof(int));
+    }
+
+    if (!scan_matches(q, conds, cond_count, aggregate_visit, &a)) goto error;
+
+    print_aggregate(out, &a);
+
+    free_aggregate(&a);
+    db_free(conds);
+    return 0;
+
+error:
+    writer_printf(out, "incorrect:'%.20s'\n", line);
+    free_aggregate(&a);
+    db_free(conds);
+    return -1;
+}
+
+
+Node* split(Node* head) {
+    Node* slow = head;
+    Node* fast = head->next;
+
+    while (fast && fast->next) {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+
+    Node* mid = slow->next;
+    slow->next = NULL;
+
+    return mid;
+}
+
+
+Node* merge(Node* a, Node* b, SortKey* keys, int n) {
+    Node dummy;
+    Node* tail = &dummy;
+
+    while (a && b) {
+        if (compare_nodes(a, b, keys, n) <= 0) {
+            tail->next = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b = b->next;
+        }
+
+        tail = tail->next;
+    }
+
+    tail->next = a ? a : b;
+
+    return dummy.next;
+}
+
+
+Node* merge_sort(Node* head, SortKey* keys, int n) {
+    if (!head || !head->next)
+        return head;
+
+    Node* mid = split(head);
+
+    head = merge_sort(head, keys, n);
+    mid = merge_sort(mid, keys, n);
+
+    return merge(head, mid, keys, n);
+}
+
+
+// bytes the encoded sort keys of a row take
+size_t sort_key_length(Node* n, SortKey* keys, int count) {
+    size_t len = 0;
+
+    for (int i = 0; i < count; i++) {
+        switch (keys[i].field) {
+            case 0: case 3: len += 4; break;
+            case 1: len += strlen(n->unit_model) + 1; break;
+            case 2: len += 8; break;
+            case 5: len += strlen(n->mechanic) + 1; break;
+            case 6: len += strlen(n->driver) + 1; break;
+        }
+    }
+
+    return len;
+}
+
+unsigned char* put_big_endian(unsigned char* dst, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--)
+        *dst++ = (unsigned char)(value >> (i * 8));
+
+    return dst;
+}
+
+// writes the sort keys of a row as a byte string whose memcmp order is the order of compare_nodes:
+// numbers are big-endian with the sign bit flipped, strings keep their terminator so no key
+// is a prefix of another, and the bytes of a desc key are inverted
+unsigned char* encode_sort_key(unsigned char* dst, Node* n, SortKey* keys, int count) {
+    for (int i = 0; i < count; i++) {
+        unsigned char* start = dst;
+        const char* str = NULL;
+
+        switch (keys[i].field) {
+            case 0: dst = put_big_endian(dst, (uint32_t)n->unit_id ^ 0x80000000u, 4); break;
+            case 1: str = n->unit_model; break;
+            case 2: dst = put_big_endian(dst, n->car_key, 8); break;
+            case 3: dst = put_big_endian(dst, (uint32_t)date_to_int(n->chk_date) ^ 0x80000000u, 4); break;
+            case 5: str = n->mechanic; break;
+            case 6: str = n->driver; break;
+        }
+
+        if (str) {
+            size_t len = strlen(str) + 1;
+            memcpy(dst, str, len);
+            dst += len;
+        }
+
+        if (keys[i].order == ORDER_DESC)
+            for (unsigned char* p = start; p < dst; p++)
+                *p = (unsigned char)~*p;
+    }
+
+    return dst;
+}
+
+// compares two keys that share their first depth bytes
+int sort_entry_less(const SortEntry* a, const SortEntry* b, size_t depth) {
+    size_t len = a->len < b->len ? a->len : b->len;
+    int cmp = memcmp(a->key + depth, b->key + depth, len - depth);
+
+    return cmp < 0 || (cmp == 0 && a->len < b->len);
+}
+
+// loads the 8 key bytes starting at depth into the prefix, zero past the end of the key
+void load_prefix(SortEntry* e, size_t depth) {
+    uint64_t prefix = 0;
+
+    for (size_t i = depth; i < depth + 8; i++)
+        prefix = prefix << 8 | (i < e->len ? e->key[i] : 0);
+
+    e->prefix = prefix;
+}
+
+// bucket of the entry at depth: 0 if the key ends before it, otherwise the key byte + 1
+#define RADIX_BUCKET(e, depth) \
+    ((e).len > (depth) ? (int)((e).prefix >> (56 - (depth) % 8 * 8) & 0xFF) + 1 : 0)
+
+// stable MSD radix sort of entries whose keys share their first depth bytes,
+// tmp has room for count entries, small buckets are finished with an insertion sort
+void radix_sort(SortEntry* e, SortEntry* tmp, int count, size_t depth) {
+    while (count > RADIX_CUTOFF) {
+        if (depth % 8 == 0)
+            for (int i = 0; i < count; i++)
+                load_prefix(&e[i], depth);
+
+        // bucket 0 holds the keys that end at depth, they are all equal
+        int counts[257] = { 0 };
+
+        for (int i = 0; i < count; i++)
+            counts[RADIX_BUCKET(e[i], depth)]++;
+
+        int b = 0;
+        while (counts[b] == 0)
+            b++;
+
+        // every key has the same byte here, go one byte deeper without moving anything
+        if (counts[b] == count) {
+            if (b == 0)
+                return;
+            depth++;
+            continue;
+        }
+
+        int starts[257];
+        int pos = 0;
+
+        for (b = 0; b < 257; b++) {
+            starts[b] = pos;
+            pos += counts[b];
+        }
+
+        for (int i = 0; i < count; i++)
+            tmp[starts[RADIX_BUCKET(e[i], depth)]++] = e[i];
+
+        memcpy(e, tmp, count * sizeof(SortEntry));
+
+        for (b = 1, pos = counts[0]; b < 257; pos += counts[b++])
+            if (counts[b] > 1)
+                radix_sort(e + pos, tmp, counts[b], depth + 1);
+
+        return;
+    }
+
+    for (int i = 1; i < count; i++) {
+        SortEntry cur = e[i];
+        int j = i;
+
+        while (j > 0 && sort_entry_less(&cur, &e[j - 1], depth)) {
+            e[j] = e[j - 1];
+            j--;
+        }
+
+        e[j] = cur;
+    }
+}
+
+// first entry of a run, every run (or group of width runs) is a slice of the array
+int run_start(SortJob* job, int run) {
+    return (int)((int64_t)run * job->count / job->runs);
+}
+
+void measure_run(void* arg, int run) {
+    SortJob* job = (SortJob*)arg;
+    size_t bytes = 0;
+
+    for (int i = run_start(job, run); i < run_start(job, run + 1); i++)
+        bytes += sort_key_length(job->src[i].row, job->keys, job->key_count);
+
+    job->offsets[run] = bytes;
+}
+
+void encode_run(void* arg, int run) {
+    SortJob* job = (SortJob*)arg;
+    unsigned char* dst = job->buf + job->offsets[run];
+
+    for (int i = run_start(job, run); i < run_start(job, run + 1); i++) {
+        job->src[i].key = dst;
+        dst = encode_sort_key(dst, job->src[i].row, job->keys, job->key_count);
+        job->src[i].len = dst - job->src[i].key;
+    }
+}
+
+void sort_run(void* arg, int run) {
+    SortJob* job = (SortJob*)arg;
+    int start = run_start(job, run);
+
+    radix_sort(job->src + start, job->dst + start, run_start(job, run + 1) - start, 0);
+}
+
+// number of entries of a that come before the first k entries of the merge of a and b,
+// ties go to a so the merge is stable
+int merge_rank(SortEntry* a, int na, SortEntry* b, int nb, int k) {
+    int lo = k > nb ? k - nb : 0;
+    int hi = k < na ? k : na;
+
+    while (lo < hi) {
+        int i = (lo + hi) / 2;
+
+        if (!sort_entry_less(&b[k - i - 1], &a[i], 0))
+            lo = i + 1;
+        else
+            hi = i;
+    }
+
+    return lo;
+}
+
+// merges one piece of a pair of neighbouring runs, the pieces of a pair don't overlap in dst
+void merge_piece(void* arg, int task) {
+    SortJob* job = (SortJob*)arg;
+    int pair = task / job->pieces;
+    int piece = task % job->pieces;
+
+    int lo = run_start(job, pair * 2 * job->width);
+    int mid = run_start(job, pair * 2 * job->width + job->width);
+    int hi = run_start(job, (pair + 1) * 2 * job->width);
+
+    SortEntry* a = job->src + lo;
+    SortEntry* b = job->src + mid;
+    int na = mid - lo;
+    int nb = hi - mid;
+
+    int k0 = (int)((int64_t)piece * (na + nb) / job->pieces);
+    int k1 = (int)((int64_t)(piece + 1) * (na + nb) / job->pieces);
+
+    int i = merge_rank(a, na, b, nb, k0);
+    int j = k0 - i;
+    int i_end = merge_rank(a, na, b, nb, k1);
+    int j_end = k1 - i_end;
+
+    SortEntry* out = job->dst + lo + k0;
+
+    while (i < i_end && j < j_end) {
+        if (sort_entry_less(&b[j], &a[i], 0))
+            *out++ = b[j++];
+        else
+            *out++ = a[i++];
+    }
+
+    while (i < i_end)
+        *out++ = a[i++];
+    while (j < j_end)
+        *out++ = b[j++];
+}
+
+// sorts the list through an array of encoded keys and relinks it once,
+// returns 0 if the array can't be allocated and the list is left as it was.
+// A large table is split into one run per task of the thread pool, the runs are
+// encoded and sorted in parallel and then merged pairwise, each merge cut into pieces
+// that the threads take in turn
+int sort_rows(Queue* q, SortKey* keys, int key_count) {
+    int count = (int)(q->next_rid - q->holes);
+
+    if (count < 2)
+        return 1;
+
+    SortJob job = { keys, key_count, NULL, NULL, count, 1, 1, 1, NULL, NULL };
+
+    if (thread_pool.count > 0 && count >= parallel_sort_rows)
+        while (job.runs < (thread_pool.count + 1) * TASKS_PER_THREAD && job.runs * 2 <= count)
+            job.runs *= 2;
+
+    SortEntry* entries = (SortEntry*)db_malloc(count * sizeof(SortEntry));
+    SortEntry* tmp = (SortEntry*)db_malloc(count * sizeof(SortEntry));
+    job.offsets = (size_t*)db_malloc(job.runs * sizeof(size_t));
+
+    int ok = entries && tmp && job.offsets;
+
+    // the rid directory already lists the rows in queue order, they are gathered
+    // before replace_rows hands out a fresh directory
+    if (ok) {
+        int i = 0;
+        for (unsigned int rid = 0; rid < q->next_rid; rid++)
+            if (live_row(q, rid))
+                entries[i++].row = q->rows[rid];
+    }
+
+    if (ok) {
+        job.src = entries;
+        job.dst = tmp;
+        pool_run(&thread_pool, job.runs, measure_run, &job);
+
+        size_t bytes = 0;
+        for (int r = 0; r < job.runs; r++) {
+            size_t size = job.offsets[r];
+            job.offsets[r] = bytes;
+            bytes += size;
+        }
+
+        // the directory is replaced last, so a sort that fails leaves it as it was
+        job.buf = (unsigned char*)db_malloc(bytes);
+        ok = job.buf != NULL && replace_rows(q);
+    }
+
+    if (ok) {
+        pool_run(&thread_pool, job.runs, encode_run, &job);
+        pool_run(&thread_pool, job.runs, sort_run, &job);
+
+        int tasks = (thread_pool.count + 1) * TASKS_PER_THREAD;
+
+        for (job.width = 1; job.width < job.runs; job.width *= 2) {
+            int pairs = job.runs / (job.width * 2);
+
+            job.pieces = (tasks + pairs - 1) / pairs;
+            pool_run(&thread_pool, pairs * job.pieces, merge_piece, &job);
+
+            SortEntry* swap = job.src;
+            job.src = job.dst;
+            job.dst = swap;
+        }
+
+        // relinks the rows in one pass, doing the work of reindex_queue on the way
+        Node* prev = NULL;
+
+        for (int i = 0; i < count; i++) {
+            Node* n = job.src[i].row;
+
+            n->prev = prev;
+            n->rid = i;
+            q->rows[i] = n;
+
+            if (prev)
+                prev->next = n;
+            prev = n;
+        }
+
+        prev->next = NULL;
+        q->head = job.src[0].row;
+        q->tail = prev;
+        q->next_rid = count;
+        q->holes = 0;
+
+        drop_indexes(q);
+    }
+
+    db_free(entries);
+    db_free(tmp);
+    db_free(job.offsets);
+    db_free(job.buf);
+    return ok;
+}
+
+int sort_db(char* line, Writer* out, Queue* q) {
+    char* args = trim(line + 4);
+
+    SortKey* keys = NULL;
+    int key_count = 0;
+
+    if (!parse_sort_keys(args, &keys, &key_count))
+        goto error;
+
+    // the list merge sort is kept for when there is no memory for the key array; the new
+    // directory is taken before the list is relinked, a sort that can't get one is not run
+    if (!sort_rows(q, keys, key_count)) {
+        if (!replace_rows(q))
+            goto error;
+
+        q->head = merge_sort(q->head, keys, key_count);
+        renumber_rows(q);
+    }
+
+    writer_printf(out, "sort:%d\n", q->size);
+
+    db_free(keys);
+
+    return 1;
+
+error:
+    writer_printf(out, "incorrect:'%.20s'\n", line);
+    db_free(keys);
+    return -1;
+}
+
+void input_close(InputReader* r) {
+    if (r->mapped) {
+        munmap(r->data, r->size);
+    } else if (r->data != NULL) {
+        db_free(r->data);
+    }
+
+    memset(r, 0, sizeof(InputReader));
+}
+
+// maps the input file, a file that can't be mapped (a pipe) is read into memory instead
+int input_open(InputReader* r, FILE* f) {
+    struct stat st;
+    int fd = fileno(f);
+
+    memset(r, 0, sizeof(InputReader));
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0)
+            return 1;
+
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            r->data = (char*)map;
+            r->size = (size_t)st.st_size;
+            r->mapped = 1;
+            return 1;
+        }
+    }
+
+    size_t cap = 0;
+
+    for (;;) {
+        if (r->size == cap) {
+            cap = cap ? cap * BUFFER_GROWTH_FACTOR : ARENA_BLOCK_SIZE;
+
+            char* tmp = (char*)db_realloc(r->data, cap);
+            if (!tmp) {
+                input_close(r);
+                return 0;
+            }
+
+            r->data = tmp;
+        }
+
+        size_t n = fread(r->data + r->size, 1, cap - r->size, f);
+        if (n == 0)
+            break;
+        r->size += n;
+    }
+
+    return !ferror(f);
+}
+
+// the next line without its line break, returns NULL at the end of the input
+const char* input_next_line(InputReader* r, size_t* len) {
+    if (r->pos >= r->size)
+        return NULL;
+
+    const char* line = r->data + r->pos;
+    const char* end = (const char*)memchr(line, '\n', r->size - r->pos);
+
+    if (!end) {
+        *len = r->size - r->pos;
+        r->pos = r->size;
+        return line;
+    }
+
+    *len = end - line;
+    r->pos += *len + 1;
+
+    if (*len > 0 && line[*len - 1] == '\r')
+        (*len)--;
+
+    return line;
+}
+
+// adds a field name to the lexed command, the operator and literal are filled in by the caller
+PlanItem* plan_push_item(PlanCache* c, int name, int name_len) {
+    if (c->item_count == c->item_cap) {
+        int cap = c->item_cap ? c->item_cap * 2 : 16;
+        PlanItem* tmp = (PlanItem*)db_realloc(c->items, cap * sizeof(PlanItem));
+        if (!tmp)
+            return NULL;
+
+        c->items = tmp;
+        c->item_cap = cap;
+    }
+
+    PlanItem* it = &c->items[c->item_count++];
+    it->name = name;
+    it->name_len = name_len;
+    it->lit = -1;
+    it->lit_len = 0;
+    return it;
+}
+
+// length of the field name at s, names are made of lowercase letters and '_'
+int plan_name_len(const char* s) {
+    int n = 0;
+    while ((s[n] >= 'a' && s[n] <= 'z') || s[n] == '_')
+        n++;
+    return n;
+}
+
+// length of the literal at s: a double quoted string without inner quotes that ends before
+// one of the stop characters, or a run of other characters up to a stop character; -1 if neither
+int plan_literal_len(const char* s, const char* stops, int spaces) {
+    int n = 0;
+
+    if (*s == '\"') {
+        n = 1;
+        while (s[n] && s[n] != '\"') {
+            if (s[n] == ' ' && !spaces)
+                return -1;
+            n++;
+        }
+
+        if (s[n] != '\"' || !strchr(stops, s[n + 1]))
+            return -1;
+
+        return n + 1;
+    }
+
+    while (!strchr(stops, s[n])) {
+        if (s[n] == '\"')
+            return -1;
+        n++;
+    }
+
+    return n;
+}
+
+// splits a select, delete or update into field names, operators and literals and builds its key.
+// only commands the regular parsers split the same way are accepted: single spaces, no spaces
+// around ',' and '=', and no quotes inside the literals. returns the command letter or 0
+char plan_lex(PlanCache* c, const char* line, size_t len) {
+    if (len + 1 > c->buf_cap) {
+        size_t cap = c->buf_cap ? c->buf_cap : INITIAL_BUFFER_SIZE;
+        while (cap < len + 1)
+            cap *= BUFFER_GROWTH_FACTOR;
+
+        char* key = (char*)db_realloc(c->key, cap);
+        if (!key)
+            return 0;
+        c->key = key;
+
+        char* bind = (char*)db_realloc(c->bind, cap);
+        if (!bind)
+            return 0;
+        c->bind = bind;
+
+        c->buf_cap = cap;
+    }
+
+    char command = line[0];
+    const char* p = line + 7;
+    char* k = c->key + 7;
+
+    memcpy(c->key, line, 7);
+    c->item_count = 0;
+
+    if (command == 's' || command == 'u') {
+        for (;;) {
+            int n = plan_name_len(p);
+            if (n == 0)
+                return 0;
+
+            PlanItem* it = plan_push_item(c, (int)(p - line), n);
+            if (!it)
+                return 0;
+
+            memcpy(k, p, n);
+            k += n;
+            p += n;
+
+            if (command == 'u') {
+                if (*p != '=')
+                    return 0;
+                *k++ = *p++;
+
+                // update splits off its conditions at the first space
+                int l = plan_literal_len(p, ", ", 0);
+                if (l < 0)
+                    return 0;
+
+                it->lit = (int)(p - line);
+                it->lit_len = l;
+                *k++ = '?';
+                p += l;
+            }
+
+            if (*p != ',')
+                break;
+            *k++ = *p++;
+        }
 
-        int found = 0;
+        c->head = c->item_count;
 
-        for (int i = 0; i < FIELD_COUNT; i++) {
-            if (strcmp(field, field_names[i]) == 0) {
-                if (seen[i]) goto error;
-                seen[i] = value;
-                found = 1;
-                break;
-            }
+        if (*p == '\0') {
+            *k = '\0';
+            return command;
         }
 
-        if (!found)
-            goto error;
+        if (*p != ' ')
+            return 0;
+        *k++ = *p++;
+    } else {
+        c->head = 0;
     }
 
-    for (int i = 0; i < FIELD_COUNT; i++)
-        if (!seen[i]) goto error;
+    for (;;) {
+        int n = plan_name_len(p);
+        if (n == 0)
+            return 0;
 
+        PlanItem* it = plan_push_item(c, (int)(p - line), n);
+        if (!it)
+            return 0;
 
-    if (!parse_int(seen[0], &new_node->unit_id)) {
-        goto error;
-    }
-    if (!parse_double_quoted_string(seen[1], new_node->unit_model, sizeof(new_node->unit_model))) {
-        goto error;
-    }
-    if (!parse_carnum(seen[2], new_node->carnum, sizeof(new_node->carnum))) {
-        goto error;
-    }
-    if (!parse_date(seen[3], &new_node->chk_date)) {
-        goto error;
-    }
-    if (!parse_status(seen[4], &new_node->status)) {
-        goto error;
-    }
-    if (!parse_double_quoted_string(seen[5], new_node->mechanic, sizeof(new_node->mechanic))) {
-        goto error;
-    }
-    if (!parse_double_quoted_string(seen[6], new_node->driver, sizeof(new_node->driver))) {
-        goto error;
-    }
-    new_node->next = NULL;
+        memcpy(k, p, n);
+        k += n;
+        p += n;
+
+        int op_len;
+        if (strncmp(p, "/not_in/", 8) == 0) { it->op = OP_NOT_IN; op_len = 8; }
+        else if (strncmp(p, "/in/", 4) == 0) { it->op = OP_IN; op_len = 4; }
+        else if (strncmp(p, ">=", 2) == 0) { it->op = OP_GE; op_len = 2; }
+        else if (strncmp(p, "<=", 2) == 0) { it->op = OP_LE; op_len = 2; }
+        else if (strncmp(p, "==", 2) == 0) { it->op = OP_EQ; op_len = 2; }
+        else if (strncmp(p, "!=", 2) == 0) { it->op = OP_NE; op_len = 2; }
+        else if (*p == '>') { it->op = OP_GT; op_len = 1; }
+        else if (*p == '<') { it->op = OP_LT; op_len = 1; }
+        else return 0;
 
-    if (queue->head == NULL) {
-        queue->head = new_node;
-        queue->tail = new_node;
-    } else {
-        (*queue->tail).next = new_node;
-        queue->tail = new_node;
+        memcpy(k, p, op_len);
+        k += op_len;
+        p += op_len;
+
+        int l = plan_literal_len(p, " ", 1);
+        if (l < 0)
+            return 0;
+
+        it->lit = (int)(p - line);
+        it->lit_len = l;
+        *k++ = '?';
+        p += l;
+
+        if (*p == '\0')
+            break;
+        *k++ = *p++;
     }
 
-    fprintf(output, "insert:%d\n", ++queue->size);
-    free(original_copy);
-    cnt_free++;
-    return;
+    *k = '\0';
+    return command;
+}
 
-error:
-    fprintf(output, "incorrect:'%.20s'\n", line);
-    free(original_copy);
-    cnt_free++;
-    free(new_node);
-    cnt_free++;
+// id of the field name of a lexed item, -1 if there is no such field
+int plan_field(const char* line, PlanItem* it) {
+    for (int i = 0; i < FIELD_COUNT; i++)
+        if (strncmp(line + it->name, field_names[i], it->name_len) == 0 && field_names[i][it->name_len] == '\0')
+            return i;
+
+    return -1;
 }
 
+// frees the cached plans, the lexer buffers are kept
+void clear_plan_cache(PlanCache* c) {
+    for (int i = 0; i < PLAN_CACHE_BUCKETS; i++) {
+        while (c->buckets[i]) {
+            Plan* next = c->buckets[i]->next;
+            db_free(c->buckets[i]);
+            c->buckets[i] = next;
+        }
+    }
 
-int parse_field_list(char* str, int** fields, int* count) {
-    *fields = NULL;
-    *count = 0;
+    c->count = 0;
+}
 
-    char* token;
+void free_plan_cache(PlanCache* c) {
+    clear_plan_cache(c);
 
-    while ((token = next_token(&str, ','))) {
+    db_free(c->items);
+    db_free(c->key);
+    db_free(c->bind);
 
-        token = trim(token);
+    c->items = NULL;
+    c->key = NULL;
+    c->bind = NULL;
+    c->item_cap = 0;
+    c->buf_cap = 0;
+}
 
-        int field = -1;
+// builds the plan of the command just lexed and adds it to the cache,
+// the cache is emptied when it is full
+void plan_insert(PlanCache* c, const char* line, char command, uint64_t hash, size_t key_len) {
+    int field_count = command == 's' ? c->head : 0;
+    int upd_count = command == 'u' ? c->head : 0;
+    int cond_count = c->item_count - c->head;
+
+    // one block: the plan, its conditions, updates, fields and key
+    size_t size = sizeof(Plan) + cond_count * sizeof(Condition) + upd_count * sizeof(Update)
+        + field_count * sizeof(int) + key_len + 1;
+
+    Plan* plan = (Plan*)db_malloc(size);
+    if (!plan)
+        return;
+
+    plan->conds = (Condition*)(plan + 1);
+    plan->upds = (Update*)(plan->conds + cond_count);
+    plan->fields = (int*)(plan->upds + upd_count);
+    plan->key = (char*)(plan->fields + field_count);
+    plan->cond_count = cond_count;
+    plan->upd_count = upd_count;
+    plan->field_count = field_count;
+    plan->command = command;
+    plan->hash = hash;
+    plan->key_len = key_len;
+    memcpy(plan->key, c->key, key_len + 1);
+
+    for (int i = 0; i < c->item_count; i++) {
+        int field = plan_field(line, &c->items[i]);
+        if (field == -1) {
+            db_free(plan);
+            return;
+        }
 
-        for (int i = 0; i < FIELD_COUNT; i++) {
-            if (strcmp(token, field_names[i]) == 0) {
-                field = i;
-                break;
-            }
+        if (i >= c->head) {
+            Condition* cond = &plan->conds[i - c->head];
+            cond->field = field;
+            cond->op = c->items[i].op;
+            cond->eval = condition_evaluators[field][cond->op];
+        } else if (command == 'u') {
+            plan->upds[i].field = field;
+        } else {
+            plan->fields[i] = field;
         }
+    }
 
-        if (field == -1)
-            return 0;
+    if (c->count == PLAN_CACHE_LIMIT)
+        clear_plan_cache(c);
 
-        int* tmp = (int*)realloc(*fields, (*count + 1) * sizeof(int));
-        if (!tmp)
-            return 0;
+    Plan** bucket = &c->buckets[hash & (PLAN_CACHE_BUCKETS - 1)];
+    plan->next = *bucket;
+    *bucket = plan;
+    c->count++;
+}
 
-        if (*fields != NULL) cnt_realloc++;
-        else cnt_malloc++;
+// parses the literals of the lexed command into the plan, in a copy of the line
+int plan_bind(PlanCache* c, Plan* plan, const char* line, size_t len) {
+    memcpy(c->bind, line, len + 1);
 
-        *fields = tmp;
-        (*fields)[*count] = field;
+    for (int i = plan->command == 's' ? c->head : 0; i < c->item_count; i++) {
+        PlanItem* it = &c->items[i];
+        char* value = c->bind + it->lit;
+        value[it->lit_len] = '\0';
 
-        (*count)++;
+        if (i >= c->head) {
+            Condition* cond = &plan->conds[i - c->head];
+            if (!parse_condition_value(cond, value))
+                return 0;
+
+            bind_condition(cond);
+        } else if (!parse_update_value(&plan->upds[i], value)) {
+            return 0;
+        }
     }
 
-    return *count > 0;
+    return 1;
 }
 
+// runs a select, delete or update through a cached plan,
+// returns 0 when the command has to go through its regular parser instead
+int plan_execute(PlanCache* c, char* line, Writer* output, Queue* queue, int* result) {
+    size_t len = strlen(line);
+    char command = plan_lex(c, line, len);
+    if (!command)
+        return 0;
 
+    size_t key_len = strlen(c->key);
+    uint64_t hash = hash_bytes(FNV_OFFSET, c->key, key_len);
 
-void print_field(FILE* out, Node* n, int field) {
-    switch (field) {
+    Plan* plan = c->buckets[hash & (PLAN_CACHE_BUCKETS - 1)];
+    while (plan && (plan->hash != hash || plan->key_len != key_len || memcmp(plan->key, c->key, key_len) != 0))
+        plan = plan->next;
 
-    case 0:
-        fprintf(out, "unit_id=%d", n->unit_id);
-        break;
+    if (!plan) {
+        c->misses++;
 
-    case 1:
-        fprintf(out, "unit_model=\"%s\"", n->unit_model);
-        break;
+        char* copy = c->bind;
+        memcpy(copy, line, len + 1);
 
-    case 2:
-        fprintf(out, "car_id='%s'", n->carnum);
-        break;
+        switch (command) {
+            case 's': *result = select_db(line, output, queue); break;
+            case 'd': *result = delete_db(line, output, queue); break;
+            default: *result = update_db(line, output, queue); break;
+        }
 
-    case 3:
-        fprintf(out, "chk_date='%02d.%02d.%d'",
-            n->chk_date.day, n->chk_date.month, n->chk_date.year);
-        break;
+        // the parsers only accept the shape when every name and operator is valid
+        if (*result >= 0)
+            plan_insert(c, copy, command, hash, key_len);
 
-    case 4:
-        fprintf(out, "status=%s",
-            status_to_string(n->status));
-        break;
+        return 1;
+    }
 
-    case 5:
-        fprintf(out, "mechanic=\"%s\"", n->mechanic);
-        break;
+    if (!plan_bind(c, plan, line, len))
+        return 0;
 
-    case 6:
-        fprintf(out, "driver=\"%s\"", n->driver);
-        break;
+    switch (command) {
+        case 's': *result = run_select(output, queue, plan->fields, plan->field_count, plan->conds, plan->cond_count, NULL); break;
+        case 'd': *result = run_delete(output, queue, plan->conds, plan->cond_count); break;
+        default: *result = run_update(output, queue, plan->upds, plan->upd_count, plan->conds, plan->cond_count); break;
     }
-}
 
-Operator parse_operator(char** p) {
-    char* s = *p;
+    if (*result < 0)
+        return 0;
 
-    if (strncmp(s, "/not_in/", 8) == 0) {
-        **p = '\0';
-        *p += 8;
-        return OP_NOT_IN;
-    }
+    c->hits++;
+    return 1;
+}
 
-    if (strncmp(s, "/in/", 4) == 0) {
-        **p = '\0';
-        *p += 4;
-        return OP_IN;
-    }
+// runs one command, returns how many rows it changed (sort counts as one change)
+// or -1 if the command was incorrect
+int execute_command(char* line, Writer* output, Queue* queue) {
+    if (strncmp(line, "insert", 6) == 0 && line[6] == ' ')
+        return insert_db(line, output, queue);
 
-    if (strncmp(s, ">=", 2) == 0) {
-        **p = '\0';
-        *p += 2;
-        return OP_GE;
-    }
+    int result;
 
-    if (strncmp(s, "<=", 2) == 0) {
-        **p = '\0';
-        *p += 2;
-        return OP_LE;
+    if (strncmp(line, "select", 6) == 0 && line[6] == ' ') {
+        if (plan_execute(&plan_cache, line, output, queue, &result))
+            return result;
+        return select_db(line, output, queue);
     }
 
-    if (strncmp(s, "==", 2) == 0) {
-        **p = '\0';
-        *p += 2;
-        return OP_EQ;
+    if (strncmp(line, "delete", 6) == 0 && line[6] == ' ') {
+        if (plan_execute(&plan_cache, line, output, queue, &result))
+            return result;
+        return delete_db(line, output, queue);
     }
 
-    if (strncmp(s, "!=", 2) == 0) {
-        **p = '\0';
-        *p += 2;
-        return OP_NE;
+    if (strncmp(line, "update", 6) == 0 && line[6] == ' ') {
+        if (plan_execute(&plan_cache, line, output, queue, &result))
+            return result;
+        return update_db(line, output, queue);
     }
 
-    if (*s == '>') {
-        **p = '\0';
-        (*p)++;
-        return OP_GT;
-    }
+    if (strncmp(line, "uniq", 4) == 0 && line[4] == ' ')
+        return uniq_db(line, output, queue);
 
-    if (*s == '<') {
-        **p = '\0';
-        (*p)++;
-        return OP_LT;
-    }
+    if (strncmp(line, "sort", 4) == 0 && line[4] == ' ')
+        return sort_db(line, output, queue);
 
-    return (Operator)-1;
+    if (strncmp(line, "aggregate", 9) == 0 && line[9] == ' ')
+        return aggregate_db(line, output, queue);
+
+    writer_printf(output, "incorrect:'%.20s'\n", line);
+    return -1;
 }
 
-int parse_condition_value(Condition* c, char* value) {
-    switch (c->field) {
-        case 0:
-            return parse_int(value, &c->value.i);
+// runs a select, delete or update the parse thread already took apart, the same way
+// select_db, delete_db and update_db do
+int execute_parsed(Command* c, Writer* output, Queue* queue) {
+    int result = -1;
 
-        case 1:
-            return parse_double_quoted_string(value, c->value.str, sizeof(c->value.str));
+    if (c->parsed && c->type == 's')
+        result = run_select(output, queue, c->fields, c->field_count, c->conds, c->cond_count, &c->order);
+    else if (c->parsed && c->type == 'd')
+        result = run_delete(output, queue, c->conds, c->cond_count);
+    else if (c->parsed && c->type == 'u')
+        result = run_update(output, queue, c->upds, c->upd_count, c->conds, c->cond_count);
 
-        case 2:
-            return parse_carnum(value, c->value.carnum, sizeof(c->value.carnum));
+    if (result < 0)
+        writer_printf(output, "incorrect:'%.20s'\n", c->work);
 
-        case 3:
-            return parse_date(value, &c->value.date);
+    return result;
+}
 
-        case 4:
-            if (value[0] == '[') {
-                size_t len = strlen(value);
-                value[len - 1] = '\0';
-                value++;
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
-                c->value.status.count = 0;
+uint32_t wal_checksum(uint64_t lsn, const char* text, size_t len) {
+    uint64_t h = hash_bytes(FNV_OFFSET, &lsn, sizeof(lsn));
+    return (uint32_t)hash_bytes(h, text, len);
+}
 
-                if (*value == '\0')
-                    return 1;
+// writes the buffered records and makes them durable with a single fsync
+int wal_commit(Wal* wal) {
+    if (wal->fd < 0 || wal->len == 0)
+        return 1;
 
-                char* token;
-                while ((token = next_token(&value, ','))) {
-                    if (c->value.status.count >= MAX_STATUS)
-                        return 0;
+    uint64_t start = now_ns();
+    size_t done = 0;
 
-                    token = trim(token);
-                    if (!parse_status(token, &c->value.status.list[c->value.status.count])) return 0;
-                    c->value.status.count++;
-                }
-                return 1;
-            }
-            else {
-                c->value.status.count = 1;
-                return parse_status(value, &c->value.status.list[0]);
-            }
-        case 5:
-        case 6:
-            return parse_double_quoted_string(value, c->value.str, sizeof(c->value.str));
+    while (done < wal->len) {
+        ssize_t n = write(wal->fd, wal->buf + done, wal->len - done);
+        if (n < 0)
+            return 0;
+        done += (size_t)n;
     }
 
-    return 0;
-}
+    int ok = fsync(wal->fd) == 0;
 
+    wal->bytes += wal->len;
+    wal->syncs++;
+    wal->len = 0;
+    wal->pending = 0;
+    wal->time_ns += now_ns() - start;
 
-int parse_conditions(char* cond_str, Condition** conds, int* count) {
-    *conds = NULL;
-    *count = 0;
+    return ok;
+}
 
-    char* token;
+// appends a record to the buffer, it is written by the next commit
+int wal_append(Wal* wal, uint64_t lsn, const char* text, size_t len) {
+    size_t need = wal->len + sizeof(WalRecord) + len;
 
-    while ((token = next_token(&cond_str, ' '))) {
-        Condition* tmp = (Condition*)realloc(*conds, (*count + 1) * sizeof(Condition));
+    if (need > wal->cap) {
+        size_t cap = wal->cap ? wal->cap : INITIAL_BUFFER_SIZE;
+        while (cap < need)
+            cap *= BUFFER_GROWTH_FACTOR;
+
+        char* tmp = (char*)db_realloc(wal->buf, cap);
         if (!tmp)
             return 0;
-        if (*conds != NULL) cnt_realloc++;
-        else cnt_malloc++;
 
-        *conds = tmp;
+        wal->buf = tmp;
+        wal->cap = cap;
+    }
 
-        Condition* c = &(*conds)[*count];
+    WalRecord r;
+    r.lsn = lsn;
+    r.length = (uint32_t)len;
+    r.checksum = wal_checksum(lsn, text, len);
 
-        char* field = token;
+    memcpy(wal->buf + wal->len, &r, sizeof(r));
+    memcpy(wal->buf + wal->len + sizeof(r), text, len);
+    wal->len = need;
 
-        while (*token && !strchr("=!<>/", *token))
-            token++;
+    return 1;
+}
 
-        c->op = parse_operator(&token);
-        if (c->op == (Operator)-1)
-            return 0;
+// opens the log and re-runs the commands the table hasn't seen yet,
+// a torn record at the end (a crash in the middle of a write) is cut off
+int wal_open(Wal* wal, const char* path, int group, Queue* q) {
+    memset(wal, 0, sizeof(Wal));
+    wal->group = group;
+    wal->fd = open(path, O_RDWR | O_CREAT, 0644);
 
-        field = trim(field);
+    if (wal->fd < 0)
+        return 0;
 
-        c->field = -1;
+    struct stat st;
+    if (fstat(wal->fd, &st) != 0)
+        return 0;
 
-        for (int i = 0; i < FIELD_COUNT; i++) {
-            if (strcmp(field, field_names[i]) == 0) {
-                c->field = i;
-                break;
-            }
-        }
+    WalHeader h;
+    size_t size = (size_t)st.st_size;
 
-        if (c->field == -1)
-            return 0;
+    if (size == 0) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, WAL_MAGIC, sizeof(h.magic));
+        h.version = WAL_VERSION;
+        h.byte_order = SNAPSHOT_BYTE_ORDER;
 
-        char* value = trim(token);
+        return write(wal->fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && fsync(wal->fd) == 0;
+    }
 
-        if (!parse_condition_value(c, value))
-            return 0;
+    if (size < sizeof(h))
+        return 0;
 
-        (*count)++;
+    char* map = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, wal->fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, WAL_MAGIC, sizeof(h.magic)) != 0 || h.version != WAL_VERSION
+        || h.byte_order != SNAPSHOT_BYTE_ORDER) {
+        munmap(map, size);
+        return 0;
     }
 
-    return 1;
-}
+    madvise(map, size, MADV_SEQUENTIAL);
 
-int cmp_int(int a, int b, Operator op) {
-    switch (op) {
-        case OP_EQ: return a == b;
-        case OP_NE: return a != b;
-        case OP_LT: return a < b;
-        case OP_LE: return a <= b;
-        case OP_GT: return a > b;
-        case OP_GE: return a >= b;
-        default: return 0;
-    }
-}
+    Writer sink;
+    writer_sink(&sink);
 
+    char* line = NULL;
+    size_t line_cap = 0;
+    size_t pos = sizeof(h);
+    int ok = 1;
 
-int cmp_str(const char* a, const char* b, Operator op) {
-    int r = strcmp(a, b);
+    while (ok && size - pos >= sizeof(WalRecord)) {
+        WalRecord r;
+        memcpy(&r, map + pos, sizeof(r));
 
-    switch (op) {
-        case OP_EQ: return r == 0;
-        case OP_NE: return r != 0;
-        case OP_LT: return r < 0;
-        case OP_LE: return r <= 0;
-        case OP_GT: return r > 0;
-        case OP_GE: return r >= 0;
-        default: return 0;
+        const char* text = map + pos + sizeof(r);
+        if (r.length > size - pos - sizeof(r) || r.checksum != wal_checksum(r.lsn, text, r.length))
+            break;
+
+        // records already in the loaded snapshot are skipped, a gap means the log belongs to another table
+        if (r.lsn > q->lsn + 1) {
+            ok = 0;
+            break;
+        }
+
+        if (r.lsn == q->lsn + 1) {
+            if (r.length + 1 > line_cap) {
+                char* tmp = (char*)db_realloc(line, r.length + 1);
+                if (!tmp) {
+                    ok = 0;
+                    break;
+                }
+
+                line = tmp;
+                line_cap = r.length + 1;
+            }
+
+            memcpy(line, text, r.length);
+            line[r.length] = '\0';
+
+            execute_command(line, &sink, q);
+            q->lsn = r.lsn;
+        }
+
+        pos += sizeof(r) + r.length;
     }
-}
 
-int carnum_digits(const char* s, int start, int len) {
-    int v = 0;
+    munmap(map, size);
 
-    for (int i = 0; i < len; i++)
-        v = v * 10 + (s[start + i] - '0');
+    db_free(line);
+    writer_close(&sink);
 
-    return v;
-}
+    if (ok && pos < size)
+        ok = ftruncate(wal->fd, (off_t)pos) == 0 && fsync(wal->fd) == 0;
 
-void carnum_letters(const char* s, char out[4]) {
-    out[0] = s[0];
-    out[1] = s[4];
-    out[2] = s[5];
-    out[3] = '\0';
+    return ok && lseek(wal->fd, 0, SEEK_END) >= 0;
 }
 
-int cmp_carnum(const char* a, const char* b, Operator op) {
-    int numA = carnum_digits(a, 1, 3);
-    int numB = carnum_digits(b, 1, 3);
-
-    if (numA != numB)
-        return cmp_int(numA, numB, op);
+// once a snapshot holds every logged command the log is emptied down to its header
+int wal_checkpoint(Wal* wal) {
+    if (!wal_commit(wal))
+        return 0;
 
-    char lettersA[4];
-    char lettersB[4];
+    return ftruncate(wal->fd, (off_t)sizeof(WalHeader)) == 0
+        && lseek(wal->fd, 0, SEEK_END) >= 0
+        && fsync(wal->fd) == 0;
+}
 
-    carnum_letters(a, lettersA);
-    carnum_letters(b, lettersB);
+void wal_close(Wal* wal) {
+    if (wal->fd >= 0)
+        close(wal->fd);
 
-    int cmp = strcmp(lettersA, lettersB);
+    db_free(wal->buf);
 
-    if (cmp != 0)
-        return cmp_str(lettersA, lettersB, op);
+    wal->fd = -1;
+    wal->buf = NULL;
+}
 
-    int lenA = (int)strlen(a);
-    int lenB = (int)strlen(b);
+// ends the run of inserts: the rows it added go into the indexes, or, if the run
+// is at least half of the table, the indexes are dropped and bulk loaded when needed
+void batch_end(InsertBatch* b, Queue* q) {
+    if (b->rows == 0)
+        return;
 
-    int regA = carnum_digits(a, 6, lenA - 6);
-    int regB = carnum_digits(b, 6, lenB - 6);
+    if ((unsigned int)b->rows * 2 > q->next_rid - q->holes)
+        drop_indexes(q);
+    else
+        for (unsigned int rid = b->first_rid; rid < q->next_rid; rid++)
+            if (live_row(q, rid))
+                index_node(q, q->rows[rid], INDEXED_FIELDS);
 
-    return cmp_int(regA, regB, op);
+    b->rows = 0;
 }
 
-int date_to_int(Date d) {
-    return d.year * 10000 + d.month * 100 + d.day;
-}
+void free_batch(InsertBatch* b) {
+    db_free(b->scratch);
 
-int cmp_date(Date a, Date b, Operator op) {
-    return cmp_int(date_to_int(a), date_to_int(b), op);
+    memset(b, 0, sizeof(InsertBatch));
 }
 
-int status_in(Status s, Status* list, int count) {
-    for (int i = 0; i < count; i++)
-        if (list[i] == s)
-            return 1;
+// grows the scratch buffer of the batch to at least size bytes
+int batch_reserve(InsertBatch* b, size_t size) {
+    if (size <= b->scratch_cap)
+        return 1;
 
-    return 0;
-}
+    size_t cap = b->scratch_cap ? b->scratch_cap : INITIAL_BUFFER_SIZE;
+    while (cap < size)
+        cap *= BUFFER_GROWTH_FACTOR;
 
-int check_condition(Node* n, Condition* c) {
-    switch (c->field) {
-        case 0:
-            return cmp_int(n->unit_id, c->value.i, c->op);
+    char* tmp = (char*)db_realloc(b->scratch, cap);
+    if (!tmp)
+        return 0;
 
-        case 1:
-            return cmp_str(n->unit_model, c->value.str, c->op);
+    b->scratch = tmp;
+    b->scratch_cap = cap;
+    return 1;
+}
 
-        case 2:
-            return cmp_carnum(n->carnum, c->value.carnum, c->op);
+// parse_date for the usual 'dd.mm.yyyy' spelling without sscanf, other spellings go to parse_date
+int parse_date_fast(char* value, Date* out) {
+    const char* v = value;
 
-        case 3:
-            return cmp_date(n->chk_date, c->value.date, c->op);
+    if (strlen(v) != 12 || v[0] != '\'' || v[3] != '.' || v[6] != '.' || v[11] != '\'')
+        return parse_date(value, out);
 
-        case 4: {
-            Status s = n->status;
+    for (int i = 1; i < 11; i++)
+        if (i != 3 && i != 6 && !isdigit((unsigned char)v[i]))
+            return parse_date(value, out);
 
-            if (c->value.status.count == 0) {
+    int d = (v[1] - '0') * 10 + (v[2] - '0');
+    int m = (v[4] - '0') * 10 + (v[5] - '0');
+    int y = (v[7] - '0') * 1000 + (v[8] - '0') * 100 + (v[9] - '0') * 10 + (v[10] - '0');
 
-                if (c->op == OP_IN)
-                    return 0;
+    if (y < 1000 || y > 2026 || m < 1 || m > 12 || d < 1 || d > days_in_month(m, y))
+        return 0;
 
-                if (c->op == OP_NOT_IN)
-                    return 1;
-            }
+    out->day = d;
+    out->month = m;
+    out->year = y;
+    return 1;
+}
 
-            if (c->op == OP_IN)
-                return status_in(s, c->value.status.list, c->value.status.count);
+// checks the fields of an insert cut apart in args and fills row with them, the strings of the row
+// point into args; returns 0 if the line is not a correct insert
+int parse_insert_fields(char* args, Node* row) {
+    char* seen[FIELD_COUNT] = { 0 };
+    char* token;
 
-            if (c->op == OP_NOT_IN)
-                return !status_in(s, c->value.status.list, c->value.status.count);
+    while ((token = next_token(&args, ','))) {
+        char* eq = strchr(token, '=');
+        if (!eq)
+            return 0;
 
-            return cmp_int((int)s, (int)c->value.status.list[0], c->op);
-        }
-        case 5:
-            return cmp_str(n->mechanic, c->value.str, c->op);
+        *eq = '\0';
+        char* field = trim(token);
+        char* value = trim(eq + 1);
 
-        case 6:
-            return cmp_str(n->driver, c->value.str, c->op);
-    }
+        if (*field == '\0' || *value == '\0')
+            return 0;
 
-    return 0;
-}
+        int f = 0;
+        while (f < FIELD_COUNT && (field[0] != field_names[f][0] || strcmp(field, field_names[f]) != 0))
+            f++;
 
+        if (f == FIELD_COUNT || seen[f])
+            return 0;
 
+        seen[f] = value;
+    }
 
-int check_conditions(Node* n, Condition* conds, int count) {
-    for (int i = 0; i < count; i++)
-        if (!check_condition(n, &conds[i]))
+    for (int i = 0; i < FIELD_COUNT; i++)
+        if (!seen[i])
             return 0;
 
+    if (!parse_int(seen[0], &row->unit_id)
+        || !parse_double_quoted_string(seen[1], &row->unit_model)
+        || !parse_carnum(seen[2], &row->carnum)
+        || !parse_date_fast(seen[3], &row->chk_date)
+        || !parse_status(seen[4], &row->status)
+        || !parse_double_quoted_string(seen[5], &row->mechanic)
+        || !parse_double_quoted_string(seen[6], &row->driver))
+        return 0;
+
+    row->car_key = carnum_key(row->carnum);
     return 1;
 }
 
+// adds a parsed row to the table without indexing it, its strings are copied into the arena;
+// returns 0 and leaves the queue as it was if there is no memory
+int batch_add(Queue* q, InsertBatch* b, const Node* row) {
+    Node* n = alloc_node(&q->pool);
+    if (!n)
+        return 0;
+
+    n->unit_id = row->unit_id;
+    n->chk_date = row->chk_date;
+    n->status = row->status;
+    n->unit_model = arena_strdup(&q->strings, row->unit_model);
+    n->carnum = arena_strdup(&q->strings, row->carnum);
+    n->car_key = row->car_key;
+    n->mechanic = arena_strdup(&q->strings, row->mechanic);
+    n->driver = arena_strdup(&q->strings, row->driver);
+
+    if (!n->unit_model || !n->carnum || !n->mechanic || !n->driver || !link_node(q, n)) {
+        release_row_strings(&q->strings, n);
+        release_node(&q->pool, n);
+        return 0;
+    }
+
+    if (b->rows++ == 0)
+        b->first_rid = n->rid;
+    return 1;
+}
 
-void select_db(char* line, FILE* output, Queue* queue) {
+// parses an insert the way insert_db does, but in the reusable scratch buffer of the batch
+// and without indexing the row, returns 0 and leaves the queue as it was if the line is
+// not a correct insert
+int bulk_parse_insert(char* line, Queue* q, InsertBatch* b) {
     char* args = line + 6;
-    args = trim(args);
+    size_t len = strlen(args) + 1;
 
-    int* fields = NULL;
-    int field_count;
+    if (*args == '\0' || !batch_reserve(b, len))
+        return 0;
 
-    Condition* conds = NULL;
-    int cond_count = 0;
+    memcpy(b->scratch, args, len);
 
-    char* cond = strchr(args, ' ');
+    Node row;
+    return parse_insert_fields(trim(b->scratch), &row) && batch_add(q, b, &row);
+}
 
-    int found = 0;
+// insert inside a run of inserts, a line the batch parser rejects goes through insert_db,
+// which prints the same incorrect: line it always did; row is the line if the parse thread
+// already took it apart
+int bulk_insert(char* line, Writer* output, Queue* q, InsertBatch* b, const Node* row) {
+    if (row ? !batch_add(q, b, row) : !bulk_parse_insert(line, q, b))
+        return insert_db(line, output, q);
 
-    if (*args == '\0') goto error;
+    writer_write(output, "insert:", 7);
+    writer_int(output, ++q->size);
+    writer_putc(output, '\n');
+    return 1;
+}
 
-    if (cond) {
-        *cond++ = '\0';
-        cond = trim(cond);
-        if (!parse_conditions(cond, &conds, &cond_count)) goto error;
+// type of a command line the way execute_command dispatches it
+int stats_type(const char* text, size_t len) {
+    for (int i = 0; i < STATS_TYPES - 1; i++) {
+        size_t n = strlen(stats_names[i]);
+        if (len > n && strncmp(text, stats_names[i], n) == 0 && text[n] == ' ')
+            return i;
     }
 
-    if (!parse_field_list(args, &fields, &field_count)) goto error;
+    return STATS_TYPES - 1;
+}
 
-    for (Node* cur = queue->head; cur; cur = cur->next) {
-        if (cond_count && !check_conditions(cur, conds, cond_count)) continue;
-        found++;
-    }
+// adds one command to the totals of its type and to the slowest commands if it is one of them
+void stats_record(Stats* stats, int type, const char* text, size_t len, long line, uint64_t ns,
+    uint64_t scanned, uint64_t matched, uint64_t modified) {
+    CommandStats* t = &stats->types[type];
 
-    fprintf(output, "select:%d\n", found);
+    t->count++;
+    t->total_ns += ns;
+    if (ns > t->max_ns)
+        t->max_ns = ns;
+    t->scanned += scanned;
+    t->matched += matched;
+    t->modified += modified;
 
-    for (Node* cur = queue->head; cur; cur = cur->next) {
-        if (cond_count && !check_conditions(cur, conds, cond_count)) continue;
+    int pos = stats->slow_count;
+    while (pos > 0 && stats->slowest[pos - 1].ns < ns)
+        pos--;
 
-        for (int i = 0; i < field_count; i++) {
-            print_field(output, cur, fields[i]);
+    if (pos == STATS_SLOWEST)
+        return;
 
-            if (i + 1 < field_count)
-                fprintf(output, " ");
-        }
+    int last = stats->slow_count < STATS_SLOWEST ? stats->slow_count++ : STATS_SLOWEST - 1;
+    memmove(&stats->slowest[pos + 1], &stats->slowest[pos], (last - pos) * sizeof(SlowCommand));
 
-        fprintf(output, "\n");
-    }
-    if (fields != NULL) {
-        free(fields);
-        cnt_free++;
-    }
-    if (conds != NULL) {
-        free(conds);
-        cnt_free++;
+    SlowCommand* slow = &stats->slowest[pos];
+    size_t n = len < STATS_TEXT_LEN ? len : STATS_TEXT_LEN;
+
+    slow->ns = ns;
+    slow->line = line;
+    memcpy(slow->text, text, n);
+    slow->text[n] = '\0';
+}
+
+int write_stats(const char* path, Stats* stats) {
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return 0;
+
+    for (int i = 0; i < STATS_TYPES; i++) {
+        CommandStats* t = &stats->types[i];
+        fprintf(f, "%s count:%ld total_us:%llu max_us:%llu rows_scanned:%llu rows_matched:%llu rows_modified:%llu\n",
+            stats_names[i], t->count, (unsigned long long)(t->total_ns / 1000), (unsigned long long)(t->max_ns / 1000),
+            (unsigned long long)t->scanned, (unsigned long long)t->matched, (unsigned long long)t->modified);
     }
-    return;
 
-error:
-    fprintf(output, "incorrect:'%.20s'\n", line);
-    free(fields);
-    cnt_free++;
-    free(conds);
-    cnt_free++;
-    return;
+    for (int i = 0; i < stats->slow_count; i++)
+        fprintf(f, "slow line:%ld us:%llu text:'%s'\n", stats->slowest[i].line,
+            (unsigned long long)(stats->slowest[i].ns / 1000), stats->slowest[i].text);
+
+    return fclose(f) == 0;
 }
 
-void delete_db(char* line, FILE* output, Queue* queue) {
-    char* args = line + 6;
+void runner_init(Runner* r, Queue* queue, Writer* output, Wal* wal, Stats* stats) {
+    memset(r, 0, sizeof(Runner));
+    r->queue = queue;
+    r->output = output;
+    r->wal = wal;
+    r->stats = stats;
+}
 
-    Condition* conds = NULL;
-    int cond_count = 0;
+// makes the logged commands durable, results written before this may be flushed after it;
+// returns 0 if the log cannot be written, the results are then held until a later commit succeeds
+int runner_commit(Runner* r) {
+    if (r->wal && !wal_commit(r->wal)) {
+        fprintf(stderr, "cannot write write-ahead log\n");
+        return 0;
+    }
 
-    Node* cur = queue->head;
-    Node* prev = NULL;
+    return 1;
+}
 
-    int deleted = 0;
+// runs one command: line is the copy the handlers may cut apart, text the line as it was read;
+// cmd is the command the parse thread already took apart, or NULL
+void run_command(Runner* r, char* line, const char* text, size_t text_length, Command* cmd) {
+    Queue* queue = r->queue;
+    Wal* wal = r->wal;
 
-    if (*args == '\0') goto error;
+    // versions the snapshots that finished were holding on to are freed before the next change
+    if (queue->versions.count > 0)
+        reclaim_versions(queue);
 
-    args = trim(args);
+    // the command is logged before it runs because running it cuts the line apart,
+    // the record is dropped again if the command turns out to change nothing
+    size_t mark = wal ? wal->len : 0;
 
-    if (!parse_conditions(args, &conds, &cond_count))
-        goto error;
+    if (wal && !wal_append(wal, queue->lsn + 1, text, strnlen(text, text_length))) {
+        fprintf(stderr, "write-ahead log is out of memory, logging stopped\n");
+        wal = r->wal = NULL;
+    }
 
-    while (cur) {
-        Node* next = cur->next;
+    // the counters are only read with --stats, a command that ends an insert batch
+    // is also charged for indexing the batch
+    uint64_t start = 0;
+    uint64_t scanned = rows_scanned;
+    uint64_t matched = rows_matched;
+    int size = queue->size;
+
+    if (r->stats)
+        start = now_ns();
+
+    // consecutive inserts are run as a batch, any other command ends it first
+    int changed;
+
+    if (cmd && cmd->type == 'i') {
+        changed = bulk_insert(line, r->output, queue, &r->batch, cmd->parsed ? &cmd->row : NULL);
+    } else if (cmd && cmd->type) {
+        batch_end(&r->batch, queue);
+        changed = execute_parsed(cmd, r->output, queue);
+    } else if (strncmp(line, "insert", 6) == 0 && line[6] == ' ') {
+        changed = bulk_insert(line, r->output, queue, &r->batch, NULL);
+    } else {
+        batch_end(&r->batch, queue);
+        changed = execute_command(line, r->output, queue);
+    }
 
-        if (check_conditions(cur, conds, cond_count)) {
-            if (prev)
-                prev->next = next;
-            else
-                queue->head = next;
+    if (r->stats) {
+        uint64_t ns = now_ns() - start;
+        int type = stats_type(text, text_length);
 
-            if (queue->tail == cur) queue->tail = prev;
+        scanned = rows_scanned - scanned;
+        matched = rows_matched - matched;
 
-            free(cur);
-            cnt_free++;
-            deleted++;
+        // uniq and sort go over the whole table, sort moves every row
+        if (type == 4 || type == 5)
+            scanned = size;
 
-        } else {
-            prev = cur;
-        }
+        uint64_t modified = changed > 0 ? (uint64_t)changed : 0;
+        if (type == 5 && changed > 0)
+            modified = size;
 
-        cur = next;
+        stats_record(r->stats, type, text, text_length, r->line_number, ns, scanned, matched, modified);
     }
 
-    queue->size -= deleted;
-    fprintf(output, "delete:%d\n", deleted);
+    if (changed > 0)
+        queue->lsn++;
 
-    if (conds != NULL) {
-        free(conds);
-        cnt_free++;
-    }
-    return;
+    if (wal && changed <= 0) {
+        wal->len = mark;
+    } else if (wal) {
+        wal->records++;
 
-error:
-    fprintf(output, "incorrect:'%.20s'\n", line);
-    free(conds);
-    cnt_free++;
+        // the results of a group are flushed only after the group is durable
+        if (++wal->pending >= wal->group && runner_commit(r))
+            writer_flush(r->output);
+    }
 }
 
-int parse_updates(char* str, Update** upds, int* count) {
-    *upds = NULL;
-    *count = 0;
+// runs one command line of len bytes, text does not have to end with '\0';
+// returns 0 if there is no memory to copy the line
+int run_line(Runner* r, const char* text, size_t text_length) {
+    r->line_number++;
 
-    char* token;
+    if (text_length == 0)
+        return 1;
 
-    while ((token = next_token(&str, ','))) {
-        token = trim(token);
+    if (text_length + 1 > r->line_cap) {
+        size_t cap = r->line_cap ? r->line_cap : INITIAL_BUFFER_SIZE;
+        while (cap < text_length + 1)
+            cap *= BUFFER_GROWTH_FACTOR;
 
-        char* eq = strchr(token, '=');
-        if (!eq) return 0;
+        char* tmp = (char*)db_realloc(r->line, cap);
+        if (!tmp)
+            return 0;
 
-        *eq = '\0';
+        r->line = tmp;
+        r->line_cap = cap;
+    }
 
-        char* field = trim(token);
-        char* value = trim(eq + 1);
+    char* line = r->line;
+    memcpy(line, text, text_length);
+    line[text_length] = '\0';
 
-        int id = -1;
-        for (int i = 0; i < FIELD_COUNT; i++)
-            if (!strcmp(field, field_names[i])) {
-                id = i;
-                break;
-            }
+    run_command(r, line, text, text_length, NULL);
+    return 1;
+}
 
-        if (id == -1) return 0;
+void runner_finish(Runner* r) {
+    batch_end(&r->batch, r->queue);
+    free_batch(&r->batch);
 
-        Update* tmp = (Update*)realloc(*upds, (*count + 1) * sizeof(Update));
+    db_free(r->line);
+    r->line = NULL;
 
-        if (!tmp) return 0;
-        if (*upds != NULL) cnt_realloc++;
-        else cnt_malloc++;
+    // results of commands that never became durable are dropped
+    if (!runner_commit(r) && r->output)
+        writer_discard(r->output);
+}
 
-        *upds = tmp;
+// runs the commands of the input, each line is copied into one reused buffer
+// because the handlers cut the text apart
+void read_input(InputReader* input, Writer* output, Queue* queue, Wal* wal, Stats* stats) {
+    const char* text;
+    size_t text_length;
+    Runner r;
 
-        Update* u = &(*upds)[*count];
-        u->field = id;
+    runner_init(&r, queue, output, wal, stats);
 
-        Condition fake;
-        fake.field = id;
+    while ((text = input_next_line(input, &text_length)) != NULL)
+        if (!run_line(&r, text, text_length))
+            break;
 
-        if (!parse_condition_value(&fake, value))
-            return 0;
+    runner_finish(&r);
+}
 
-        memcpy(&u->value, &fake.value, sizeof(u->value));
+// sleeps until the other side of the ring moves index away from seen or sets done,
+// sleeping counts the sides the other one has to wake (both can be asleep for a moment
+// while one of them has been woken but not yet run)
+void ring_wait(CommandRing* r, const size_t* index, size_t seen, const int* done) {
+    pthread_mutex_lock(&r->lock);
+    __atomic_add_fetch(&r->sleeping, 1, __ATOMIC_SEQ_CST);
 
-        (*count)++;
-    }
+    while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == seen && !__atomic_load_n(done, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&r->wake, &r->lock);
 
-    return *count > 0;
+    __atomic_sub_fetch(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
 }
 
-void apply_update(Node* n, Update* upds, int count) {
-    for (int i = 0; i < count; i++) {
-        switch (upds[i].field) {
+void ring_signal(CommandRing* r) {
+    if (!__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST))
+        return;
 
-            case 0:
-                n->unit_id = upds[i].value.i;
-                break;
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
 
-            case 1:
-                strcpy(n->unit_model, upds[i].value.str);
-                break;
+// free slot for the parser, NULL once the executor asked it to stop
+Command* ring_slot(CommandRing* r) {
+    size_t head;
 
-            case 2:
-                strcpy(n->carnum, upds[i].value.carnum);
-                break;
+    while (r->tail - (head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST)) == PIPELINE_SLOTS) {
+        if (__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST))
+            return NULL;
+        ring_wait(r, &r->head, head, &r->stop);
+    }
 
-            case 3:
-                n->chk_date = upds[i].value.date;
-                break;
+    return &r->slots[r->tail % PIPELINE_SLOTS];
+}
 
-            case 4:
-                n->status = upds[i].value.status;
-                break;
+void ring_publish(CommandRing* r) {
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+    ring_signal(r);
+}
 
-            case 5:
-                strcpy(n->mechanic, upds[i].value.str);
-                break;
+void ring_close(CommandRing* r) {
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    ring_signal(r);
+}
 
-            case 6:
-                strcpy(n->driver, upds[i].value.str);
-                break;
+// next parsed command for the executor, NULL after the last one
+Command* ring_take(CommandRing* r) {
+    for (;;) {
+        if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head)
+            return &r->slots[r->head % PIPELINE_SLOTS];
+
+        // the parser publishes its last command before it closes the ring
+        if (__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST)) {
+            if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == r->head)
+                return NULL;
+            continue;
         }
+
+        ring_wait(r, &r->tail, r->head, &r->closed);
     }
 }
 
-void update_db(char* line, FILE* out, Queue* q) {
-    char* args = trim(line + 6);
-
-    Update* upds = NULL;
-    int upd_count = 0;
+void ring_release(CommandRing* r) {
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+    ring_signal(r);
+}
 
-    Condition* conds = NULL;
-    int cond_count = 0;
+// copies a line into the slot and takes it apart the way the handlers would,
+// returns 0 if there is no memory for the copies
+int parse_command(Command* c, const char* text, size_t len, long line_number) {
+    if (2 * (len + 1) > c->cap) {
+        size_t cap = c->cap ? c->cap : INITIAL_BUFFER_SIZE;
+        while (cap < 2 * (len + 1))
+            cap *= BUFFER_GROWTH_FACTOR;
 
-    char* cond = strchr(args, ' ');
-    int updated = 0;
+        char* tmp = (char*)db_realloc(c->work, cap);
+        if (!tmp)
+            return 0;
 
+        c->work = tmp;
+        c->cap = cap;
+    }
 
-    if (*args == '\0') goto error;
+    char* work = c->work;
+    memcpy(work, text, len);
+    work[len] = '\0';
+
+    c->text = text;
+    c->len = len;
+    c->line_number = line_number;
+    c->type = 0;
+    c->parsed = 0;
+    c->fields = NULL;
+    c->conds = NULL;
+    c->upds = NULL;
+    c->order.keys = NULL;
+    c->field_count = c->cond_count = c->upd_count = 0;
+
+    if (len <= 6 || work[6] != ' ')
+        return 1;
 
-    if (cond) {
-        *cond++ = '\0';
-        cond = trim(cond);
-        if (!parse_conditions(cond, &conds, &cond_count))
-            goto error;
+    if (strncmp(work, "insert", 6) == 0) {
+        // the row is parsed from a second copy, an insert it rejects still needs the whole line
+        char* args = work + len + 1;
+        memcpy(args, work + 6, len - 5);
+
+        c->type = 'i';
+        c->parsed = *args != '\0' && parse_insert_fields(trim(args), &c->row);
+    } else if (strncmp(work, "select", 6) == 0) {
+        c->type = 's';
+        c->parsed = parse_select(work, &c->fields, &c->field_count, &c->conds, &c->cond_count, &c->order);
+    } else if (strncmp(work, "delete", 6) == 0) {
+        c->type = 'd';
+        c->parsed = parse_delete(work, &c->conds, &c->cond_count);
+    } else if (strncmp(work, "update", 6) == 0) {
+        c->type = 'u';
+        c->parsed = parse_update(work, &c->upds, &c->upd_count, &c->conds, &c->cond_count);
     }
 
-    if (!parse_updates(args, &upds, &upd_count))
-        goto error;
+    return 1;
+}
 
-    for (Node* cur = q->head; cur; cur = cur->next) {
+void* parse_thread(void* arg) {
+    CommandRing* r = (CommandRing*)arg;
+    const char* text;
+    size_t len;
+    long line_number = 0;
+
+    while ((text = input_next_line(r->input, &len)) != NULL) {
+        line_number++;
 
-        if (cond_count && !check_conditions(cur, conds, cond_count))
+        if (len == 0)
             continue;
 
-        apply_update(cur, upds, upd_count);
-        updated++;
+        Command* c = ring_slot(r);
+        if (!c || !parse_command(c, text, len, line_number))
+            break;
+
+        ring_publish(r);
     }
 
-    fprintf(out, "update:%d\n", updated);
+    ring_close(r);
+    return NULL;
+}
 
-    if (upds != NULL) {
-        free(upds);
-        cnt_free++;
+// runs the input on three threads: the parse thread takes the lines apart, this thread runs
+// them in input order and the output thread writes the results; falls back to read_input
+// if the threads cannot be started
+void pipeline_input(InputReader* input, Writer* output, Queue* queue, Wal* wal, Stats* stats) {
+    CommandRing ring;
+    memset(&ring, 0, sizeof(CommandRing));
+    ring.input = input;
+
+    ring.slots = (Command*)db_malloc(PIPELINE_SLOTS * sizeof(Command));
+    if (!ring.slots) {
+        read_input(input, output, queue, wal, stats);
+        return;
     }
-    if (conds != NULL) {
-        free(conds);
-        cnt_free++;
+
+    memset(ring.slots, 0, PIPELINE_SLOTS * sizeof(Command));
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.wake, NULL);
+
+    pthread_t parser;
+    if (pthread_create(&parser, NULL, parse_thread, &ring) != 0) {
+        read_input(input, output, queue, wal, stats);
+        goto done;
     }
-    return;
 
-error:
-    fprintf(out, "incorrect:'%.20s'\n", line);
-    free(upds);
-    cnt_free++;
-    free(conds);
-    cnt_free++;
-}
+    output_stage_start(output);
 
-void reverse_queue(Queue* q) {
-    Node* old_head = q->head;
+    Runner r;
+    runner_init(&r, queue, output, wal, stats);
 
-    Node* prev = NULL;
-    Node* cur = q->head;
+    Command* c;
+    while ((c = ring_take(&ring)) != NULL) {
+        r.line_number = c->line_number;
+        run_command(&r, c->work, c->text, c->len, c);
 
-    while (cur) {
-        Node* next = cur->next;
-        cur->next = prev;
-        prev = cur;
-        cur = next;
+        db_free(c->fields);
+        db_free(c->conds);
+        db_free(c->upds);
+        db_free(c->order.keys);
+        ring_release(&ring);
     }
 
-    q->head = prev;
-    q->tail = old_head;
+    pthread_join(parser, NULL);
+    runner_finish(&r);
+    output_stage_stop(output);
+
+done:
+    for (int i = 0; i < PIPELINE_SLOTS; i++)
+        db_free(ring.slots[i].work);
+    db_free(ring.slots);
+
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.wake);
 }
 
-int check_carnum(char* a, char* b) {
-    if (strncmp(a, b, 6)) return 1;
-    int reg_a = atoi(a + 6);
-    int reg_b = atoi(b + 6);
+// set by SIGINT and SIGTERM, the server stops after the commands it already read
+volatile sig_atomic_t server_stop = 0;
 
-    return reg_a != reg_b;
+void stop_server(int sig) {
+    (void)sig;
+    server_stop = 1;
 }
 
-int nodes_equal(Node* a, Node* b, int* fields, int count) {
-    for (int i = 0; i < count; i++) {
-        switch (fields[i]) {
+void* reader_thread(void* arg) {
+    ReaderPool* p = (ReaderPool*)arg;
 
-        case 0:
-            if (a->unit_id != b->unit_id) return 0;
-            break;
+    pthread_mutex_lock(&p->lock);
 
-        case 1:
-            if (strcmp(a->unit_model, b->unit_model)) return 0;
-            break;
+    for (;;) {
+        while (!p->stop && !p->pending)
+            pthread_cond_wait(&p->wake, &p->lock);
 
-        case 2:
-            if (check_carnum(a->carnum, b->carnum)) return 0;
+        // the jobs already handed out are run before the thread stops
+        ReadJob* job = p->pending;
+        if (!job)
             break;
 
-        case 3:
-            if (memcmp(&a->chk_date, &b->chk_date, sizeof(Date)))
-                return 0;
-            break;
+        p->pending = job->next;
+        if (!p->pending)
+            p->pending_tail = NULL;
 
-        case 4:
-            if (a->status != b->status) return 0;
-            break;
+        pthread_mutex_unlock(&p->lock);
 
-        case 5:
-            if (strcmp(a->mechanic, b->mechanic)) return 0;
-            break;
-        case 6:
-            if (strcmp(a->driver, b->driver)) return 0;
-            break;
-        }
-    }
+        uint64_t start = now_ns();
+        char* line = job->line + job->len + 1;
 
-    return 1;
-}
+        memcpy(line, job->line, job->len + 1);
+        snapshot_select(line, &job->client->out, &job->snapshot, &job->scanned, &job->matched);
+        job->ns = now_ns() - start;
 
+        pthread_mutex_lock(&p->lock);
+        job->next = p->done;
+        p->done = job;
 
-void uniq_db(char* args, FILE* out, Queue* q) {
-    args = trim(args + 4);
-    reverse_queue(q);
+        // a full pipe already wakes the server
+        char byte = 0;
+        write_all(p->pipe[1], &byte, 1);
+    }
 
-    int* fields = NULL;
-    int field_count;
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
 
-    Node** seen = NULL;
-    int seen_count = 0;
+// starts the reader threads, a pool without threads runs every select on the server thread
+void readers_start(ReaderPool* p, int threads) {
+    memset(p, 0, sizeof(ReaderPool));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    p->pipe[0] = -1;
+    p->pipe[1] = -1;
 
-    Node* prev = NULL;
-    Node* cur = q->head;
+    if (threads <= 0 || pipe(p->pipe) != 0)
+        return;
+
+    fcntl(p->pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(p->pipe[1], F_SETFL, O_NONBLOCK);
 
-    int removed = 0;
+    p->threads = (pthread_t*)db_malloc(threads * sizeof(pthread_t));
+    if (!p->threads)
+        return;
 
-    if (!parse_field_list(args, &fields, &field_count)) goto error;
+    while (p->count < threads && pthread_create(&p->threads[p->count], NULL, reader_thread, p) == 0)
+        p->count++;
+}
 
-    while (cur) {
+void readers_stop(ReaderPool* p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
 
-        int duplicate = 0;
+    for (int i = 0; i < p->count; i++)
+        pthread_join(p->threads[i], NULL);
 
-        for (int i = 0; i < seen_count; i++) {
-            if (nodes_equal(cur, seen[i], fields, field_count)) {
-                duplicate = 1;
-                break;
-            }
-        }
+    db_free(p->threads);
 
-        if (duplicate) {
+    if (p->pipe[0] >= 0) {
+        close(p->pipe[0]);
+        close(p->pipe[1]);
+    }
 
-            Node* del = cur;
+    long reads = p->reads;
 
-            if (prev)
-                prev->next = cur->next;
-            else
-                q->head = cur->next;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    memset(p, 0, sizeof(ReaderPool));
+    p->reads = reads;
+}
 
-            cur = cur->next;
+// hands a select to the reader threads with a snapshot of the table as the commands before it
+// left it, returns 0 if the line has to run on the server thread
+int dispatch_read(ReaderPool* p, Runner* r, Client* c, const char* text, size_t len) {
+    if (!p || p->count == 0 || len < 7 || strncmp(text, "select ", 7) != 0)
+        return 0;
 
-            free(del);
-            cnt_free++;
-            removed++;
-            continue;
-        }
+    // the line is kept for the stats, the reader cuts apart a copy behind it
+    ReadJob* job = (ReadJob*)db_malloc(sizeof(ReadJob) + 2 * (len + 1));
+    if (!job)
+        return 0;
 
-        Node** tmp = (Node**)realloc(seen, (seen_count + 1) * sizeof(Node*));
+    Queue* q = r->queue;
+    Versions* v = &q->versions;
+
+    job->client = c;
+    job->snapshot.rows = q->rows;
+    job->snapshot.count = q->next_rid;
+    job->snapshot.lsn = q->lsn;
+    job->line_number = ++r->line_number;
+    job->ns = 0;
+    job->scanned = 0;
+    job->matched = 0;
+    job->next = NULL;
+    job->len = len;
+    memcpy(job->line, text, len);
+    job->line[len] = '\0';
+
+    if (v->snapshots++ == 0)
+        v->oldest = q->lsn;
+
+    c->job = job;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->pending_tail)
+        p->pending_tail->next = job;
+    else
+        p->pending = job;
+    p->pending_tail = job;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
 
-        if (!tmp) break;
+    return 1;
+}
 
-        if (seen != NULL) cnt_realloc++;
-        else cnt_malloc++;
+// the results are held until the server sends them, after the commands before them are durable
+int client_open(Client* c, int in, int out) {
+    memset(c, 0, sizeof(Client));
+    c->fd = in;
 
-        seen = tmp;
-        seen[seen_count++] = cur;
+    if (!writer_attach(&c->out, out))
+        return 0;
 
-        prev = cur;
-        cur = cur->next;
-    }
+    c->out.hold = 1;
+    return 1;
+}
 
-    reverse_queue(q);
+// closes the connection, a socket client reads and writes the same fd
+void client_close(Client* c) {
+    int shared = c->fd == c->out.fd;
 
-    free(seen);
-    cnt_free++;
-    free(fields);
-    cnt_free++;
+    writer_close(&c->out);
 
-    fprintf(out, "uniq:%d\n", removed);
-    return;
+    if (!shared && c->fd > 0)
+        close(c->fd);
 
-error:
-    fprintf(out, "incorrect:'%.20s'\n", args);
-    free(seen);
-    cnt_free++;
-    free(fields);
-    cnt_free++;
-    return;
+    db_free(c->buf);
+    c->buf = NULL;
 }
 
+// runs the complete lines the client sent; a select that goes to a reader thread holds back the
+// lines after it until its results are written, done is set once the client closed and all its lines ran
+void client_run(Client* c, Runner* r, ReaderPool* readers) {
+    r->output = &c->out;
 
-int parse_sort_keys(char* str, SortKey** keys, int* count)
-{
-    *keys = NULL;
-    *count = 0;
+    while (!c->job && !c->done) {
+        char* line = c->buf + c->pos;
+        size_t rest = c->len - c->pos;
 
-    char* token;
+        if (rest == 0) {
+            c->done = c->eof;
+            break;
+        }
 
-    while ((token = next_token(&str, ','))) {
+        // the last line may come without a newline
+        char* nl = (char*)memchr(line, '\n', rest);
+        if (!nl && !c->eof)
+            break;
 
-        char* eq = strchr(token, '=');
-        if (!eq) return 0;
+        size_t len = nl ? (size_t)(nl - line) : rest;
+        c->pos += nl ? len + 1 : len;
 
-        *eq = '\0';
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
 
-        char* field = trim(token);
-        char* ord = trim(eq + 1);
+        if (!dispatch_read(readers, r, c, line, len) && !run_line(r, line, len))
+            c->done = 1;
+    }
+}
 
-        int f = -1;
+// reads what the client sent and runs its complete lines, a client may send any number
+// of lines without waiting for their results
+void client_read(Client* c, Runner* r, ReaderPool* readers) {
+    if (c->pos > 0) {
+        memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+        c->len -= c->pos;
+        c->pos = 0;
+    }
 
-        for (int i = 0; i < FIELD_COUNT; i++) {
-            if (strcmp(field, field_names[i]) == 0) {
-                f = i;
-                break;
-            }
+    if (c->len == c->cap) {
+        size_t cap = c->cap ? c->cap * BUFFER_GROWTH_FACTOR : CLIENT_BUFFER_SIZE;
+
+        char* tmp = (char*)db_realloc(c->buf, cap);
+        if (!tmp) {
+            c->done = 1;
+            return;
         }
 
-        if (f == -1)
-            return 0;
+        c->buf = tmp;
+        c->cap = cap;
+    }
 
-        if (f == 4)
-            return 0;
+    ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len);
+    if (n < 0 && errno == EINTR)
+        return;
 
-        for (int i = 0; i < *count; i++)
-            if ((*keys)[i].field == f)
-                return 0;
+    if (n <= 0)
+        c->eof = 1;
+    else
+        c->len += (size_t)n;
 
-        SortKey* tmp = (SortKey*)realloc(*keys, (*count + 1) * sizeof(SortKey));
+    client_run(c, r, readers);
+}
 
-        if (!tmp) return 0;
+// takes the selects the reader threads finished; with resume their clients go on with the lines after them
+void collect_reads(ReaderPool* p, Runner* r, Client** clients, int count, int resume) {
+    char bytes[64];
+    while (read(p->pipe[0], bytes, sizeof(bytes)) > 0)
+        ;
 
-        if (*keys != NULL) cnt_realloc++;
-        else cnt_malloc++;
+    pthread_mutex_lock(&p->lock);
+    ReadJob* job = p->done;
+    p->done = NULL;
+    pthread_mutex_unlock(&p->lock);
 
-        *keys = tmp;
+    Versions* v = &r->queue->versions;
+    ReadJob* finished = job;
 
-        (*keys)[*count].field = f;
-        if (!strcmp(ord, "asc")) (*keys)[*count].order = ORDER_ASC;
-        else if (!strcmp(ord, "desc")) (*keys)[*count].order = ORDER_DESC;
-        else return 0;
+    for (; job; job = job->next) {
+        if (r->stats)
+            stats_record(r->stats, stats_type(job->line, job->len), job->line, job->len, job->line_number,
+                job->ns, job->scanned, job->matched, 0);
 
-        (*count)++;
+        job->client->job = NULL;
+        v->snapshots--;
+        p->reads++;
     }
 
-    return *count > 0;
+    // the oldest snapshot still open decides what the writer may free
+    v->oldest = r->queue->lsn;
+    for (int i = 0; i < count; i++)
+        if (clients[i]->job && clients[i]->job->snapshot.lsn < v->oldest)
+            v->oldest = clients[i]->job->snapshot.lsn;
+
+    while (finished) {
+        Client* c = finished->client;
+        ReadJob* next = finished->next;
+
+        db_free(finished);
+        finished = next;
+
+        if (resume)
+            client_run(c, r, p);
+    }
 }
 
+// serves the commands of stdin on stdout until the input ends
+int serve_stdio(Runner* r) {
+    Client c;
+    if (!client_open(&c, STDIN_FILENO, STDOUT_FILENO))
+        return 0;
 
-Node* split(Node* head) {
-    Node* slow = head;
-    Node* fast = head->next;
+    int durable = 1;
 
-    while (fast && fast->next) {
-        slow = slow->next;
-        fast = fast->next->next;
+    while (!c.done && !server_stop) {
+        client_read(&c, r, NULL);
+
+        durable = runner_commit(r);
+        if (durable)
+            writer_flush(&c.out);
     }
 
-    Node* mid = slow->next;
-    slow->next = NULL;
+    // results of commands that never became durable are not sent
+    if (!durable)
+        writer_discard(&c.out);
 
-    return mid;
+    client_close(&c);
+    return 1;
 }
 
+// serves the clients of a Unix domain socket until SIGINT or SIGTERM; the commands of all clients run
+// one at a time on this thread, each client gets the results of its own commands; with reader threads
+// a select runs on a snapshot next to the commands of the other clients
+int serve_socket(Runner* r, const char* path, ReaderPool* readers) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
 
-int compare_nodes(Node* a, Node* b, SortKey* keys, int n) {
-    for (int i = 0; i < n; i++) {
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return 0;
+    strcpy(addr.sun_path, path);
 
-        int cmp = 0;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        return 0;
 
-        switch (keys[i].field) {
+    unlink(path);
 
-        case 0:
-            cmp = (a->unit_id > b->unit_id) - (a->unit_id < b->unit_id);
-            break;
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        close(listener);
+        return 0;
+    }
 
-        case 1:
-            cmp = strcmp(a->unit_model, b->unit_model);
-            break;
+    // a reader thread writes into its client, so a client keeps its place in memory
+    Client* clients[SERVER_CLIENTS];
+    struct pollfd fds[SERVER_CLIENTS + 2];
+    int count = 0;
+
+    while (!server_stop) {
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        fds[1].fd = readers->count ? readers->pipe[0] : -1;
+        fds[1].events = POLLIN;
+
+        // a client whose select is running is left alone until the select is done,
+        // one with more than CLIENT_OUTPUT_LIMIT bytes unsent is not read until it takes them
+        for (int i = 0; i < count; i++) {
+            Client* c = clients[i];
+            short events = 0;
+
+            if (!c->job && !c->done && c->out.len - c->out.sent < CLIENT_OUTPUT_LIMIT)
+                events |= POLLIN;
+            if (!c->job && c->out.sent < c->out.ready)
+                events |= POLLOUT;
+
+            fds[i + 2].fd = events ? c->fd : -1;
+            fds[i + 2].events = events;
+            fds[i + 2].revents = 0;
+        }
 
-        case 2:
-            cmp = cmp_carnum(a->carnum, b->carnum, OP_GT) - cmp_carnum(a->carnum, b->carnum, OP_LT);
+        if (poll(fds, count + 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
             break;
+        }
 
-        case 3:
-            cmp = cmp_date(a->chk_date, b->chk_date, OP_GT) - cmp_date(a->chk_date, b->chk_date, OP_LT);
-            break;
+        if (fds[1].revents)
+            collect_reads(readers, r, clients, count, 1);
 
-        case 5:
-            cmp = strcmp(a->mechanic, b->mechanic);
-            break;
+        for (int i = 0; i < count; i++)
+            if ((fds[i + 2].events & POLLIN) && (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+                && !clients[i]->job && !clients[i]->done)
+                client_read(clients[i], r, readers);
 
-        case 6:
-            cmp = strcmp(a->driver, b->driver);
-            break;
+        int durable = runner_commit(r);
+
+        // from the last client down, so a closed client can be replaced by the last one;
+        // the output of a client whose select is running belongs to the reader thread
+        for (int i = count - 1; i >= 0; i--) {
+            Client* c = clients[i];
+
+            if (c->job)
+                continue;
+
+            // results of commands that never became durable are not sent
+            if (durable)
+                c->out.ready = c->out.len;
+            else if (c->done)
+                writer_discard(&c->out);
+
+            writer_send(&c->out);
+
+            // a client that is done is closed once it took its results
+            if (!c->done || c->out.len > 0)
+                continue;
+
+            client_close(c);
+            db_free(c);
+            clients[i] = clients[--count];
         }
 
-        if (cmp != 0) {
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
 
-            if (keys[i].order == ORDER_DESC)
-                cmp = -cmp;
+            // replies are sent without blocking, so a client that does not read holds up nobody else
+            if (fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+                close(fd);
+                fd = -1;
+            }
 
-            return cmp;
+            Client* c = fd >= 0 && count < SERVER_CLIENTS ? (Client*)db_malloc(sizeof(Client)) : NULL;
+
+            if (c && client_open(c, fd, fd)) {
+                clients[count++] = c;
+            } else {
+                if (fd >= 0)
+                    close(fd);
+                db_free(c);
+            }
         }
     }
 
-    return 0;
-}
+    // the selects still running write into their clients
+    while (r->queue->versions.snapshots > 0) {
+        struct pollfd wait = { readers->pipe[0], POLLIN, 0 };
+        poll(&wait, 1, -1);
+        collect_reads(readers, r, clients, count, 0);
+    }
 
+    int durable = runner_commit(r);
 
-Node* merge(Node* a, Node* b, SortKey* keys, int n) {
-    Node dummy;
-    Node* tail = &dummy;
+    // the results the clients have not taken yet are sent while they keep reading,
+    // a client that takes nothing for SERVER_DRAIN_MS loses the rest
+    for (;;) {
+        int waiting = 0;
 
-    while (a && b) {
-        if (compare_nodes(a, b, keys, n) <= 0) {
-            tail->next = a;
-            a = a->next;
-        } else {
-            tail->next = b;
-            b = b->next;
+        for (int i = 0; i < count; i++) {
+            Writer* out = &clients[i]->out;
+
+            if (durable)
+                out->ready = out->len;
+            else
+                writer_discard(out);
+
+            writer_send(out);
+
+            if (out->len > 0) {
+                fds[waiting].fd = clients[i]->fd;
+                fds[waiting].events = POLLOUT;
+                fds[waiting].revents = 0;
+                waiting++;
+            }
         }
 
-        tail = tail->next;
+        if (waiting == 0 || poll(fds, waiting, SERVER_DRAIN_MS) <= 0)
+            break;
     }
 
-    tail->next = a ? a : b;
+    for (int i = 0; i < count; i++) {
+        client_close(clients[i]);
+        db_free(clients[i]);
+    }
 
-    return dummy.next;
+    close(listener);
+    unlink(path);
+    return 1;
 }
 
+// runs as a server on a socket, or on stdin and stdout if path is NULL
+int serve(Queue* queue, Wal* wal, Stats* stats, const char* path) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-Node* merge_sort(Node* head, SortKey* keys, int n) {
-    if (!head || !head->next)
-        return head;
+    // a client that goes away shows up as a failed write, not as a signal
+    signal(SIGPIPE, SIG_IGN);
 
-    Node* mid = split(head);
+    Runner r;
+    runner_init(&r, queue, NULL, wal, stats);
 
-    head = merge_sort(head, keys, n);
-    mid = merge_sort(mid, keys, n);
+    int ok = path ? serve_socket(&r, path, &reader_pool) : serve_stdio(&r);
 
-    return merge(head, mid, keys, n);
+    Writer sink;
+    writer_sink(&sink);
+    r.output = &sink;
+
+    runner_finish(&r);
+    return ok;
 }
 
+void free_db(struct Queue* queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->size = 0;
 
-void sort_db(char* line, FILE* out, Queue* q) {
-    char* args = trim(line + 4);
+    free_id_index(&queue->id_index);
+    free_date_index(&queue->date_index);
+    free_status_index(&queue->status_index);
+    free_pool(&queue->pool);
+    free_arena(&queue->strings);
 
-    SortKey* keys = NULL;
-    int key_count = 0;
+    // retired rows live in the slabs, only the directories are freed one by one
+    Versions* v = &queue->versions;
+    for (size_t i = v->head; i < v->head + v->count; i++)
+        if (v->items[i].kind == RETIRED_DIRECTORY)
+            db_free(v->items[i].ptr);
 
-    if (!parse_sort_keys(args, &keys, &key_count))
-        goto error;
+    db_free(v->items);
+    memset(v, 0, sizeof(Versions));
 
-    q->head = merge_sort(q->head, keys, key_count);
+    db_free(queue->rows);
 
-    fprintf(out, "sort:%d\n", q->size);
+    queue->rows = NULL;
+    queue->rows_cap = 0;
+    queue->next_rid = 0;
+    queue->holes = 0;
+}
 
-    if (keys != NULL) {
-        free(keys);
-        cnt_free++;
-    }
+// offset of the next string in the string block of a snapshot being written
+uint32_t snapshot_offset(const char* str, uint64_t* strings_size) {
+    uint32_t offset = (uint32_t)*strings_size;
 
-    return;
+    *strings_size += strlen(str) + 1;
 
-error:
-    fprintf(out, "incorrect:'%.20s'\n", line);
-    free(keys);
-    cnt_free++;
+    return offset;
 }
 
-// Dynamic line reading function using fgets
-char* read_dynamic_line(FILE* input, size_t* line_length) {
-    size_t buffer_size = INITIAL_BUFFER_SIZE;
-    char* buffer = (char*)malloc(buffer_size);
-    if (!buffer) {
-        return NULL;
+// writes the queue to a temporary file next to path and renames it over path
+int save_snapshot(const char* path, Queue* q) {
+    size_t tmp_len = strlen(path) + 5;
+    char* tmp_path = (char*)db_malloc(tmp_len);
+    if (!tmp_path)
+        return 0;
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f) {
+        db_free(tmp_path);
+        return 0;
     }
-    cnt_malloc++;
 
-    buffer[0] = '\0';
-    size_t pos = 0;
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.byte_order = SNAPSHOT_BYTE_ORDER;
+    h.record_size = sizeof(SnapshotRecord);
+    h.queue_size = q->size;
+    h.lsn = q->lsn;
+
+    for (Node* cur = q->head; cur; cur = cur->next)
+        h.count++;
+
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    // records first, their strings follow in the same order
+    for (Node* cur = q->head; ok && cur; cur = cur->next) {
+        SnapshotRecord r;
+        memset(&r, 0, sizeof(r));
+
+        r.unit_id = cur->unit_id;
+        r.chk_date = date_to_int(cur->chk_date);
+        r.status = (int32_t)cur->status;
+        r.car_key = cur->car_key;
+        r.unit_model = snapshot_offset(cur->unit_model, &h.strings_size);
+        r.carnum = snapshot_offset(cur->carnum, &h.strings_size);
+        r.mechanic = snapshot_offset(cur->mechanic, &h.strings_size);
+        r.driver = snapshot_offset(cur->driver, &h.strings_size);
+
+        ok = fwrite(&r, sizeof(r), 1, f) == 1 && h.strings_size <= UINT32_MAX;
+    }
 
-    while (1) {
-        if (fgets(buffer + pos, (int)(buffer_size - pos), input) == NULL) {
-            if (pos == 0) {
-                free(buffer);
-                cnt_free++;
-                return NULL;
-            }
-            break;
-        }
+    for (Node* cur = q->head; ok && cur; cur = cur->next) {
+        ok = fputs(cur->unit_model, f) >= 0 && fputc('\0', f) != EOF
+            && fputs(cur->carnum, f) >= 0 && fputc('\0', f) != EOF
+            && fputs(cur->mechanic, f) >= 0 && fputc('\0', f) != EOF
+            && fputs(cur->driver, f) >= 0 && fputc('\0', f) != EOF;
+    }
 
-        size_t len = strlen(buffer + pos);
-        pos += len;
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(tmp_path, path) == 0;
 
-        if (len > 0 && buffer[pos - 1] == '\n') {
-            break;
-        }
+    if (!ok)
+        remove(tmp_path);
 
-        if (pos >= buffer_size - 1) {
-            size_t new_size = buffer_size * BUFFER_GROWTH_FACTOR;
-            char* new_buffer = (char*)realloc(buffer, new_size);
-            if (!new_buffer) {
-                free(buffer);
-                cnt_free++;
-                return NULL;
-            }
-            cnt_realloc++;
-            buffer = new_buffer;
-            buffer_size = new_size;
-        }
+    db_free(tmp_path);
+    return ok;
+}
+
+// maps a snapshot and links its records into an empty queue, the strings stay in the mapping
+int load_snapshot(const char* path, Queue* q) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return 0;
     }
 
-    *line_length = pos;
-    return buffer;
-}
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-void read_input(FILE* input, FILE* output, Queue* queue) {
-    char* line;
-    size_t line_length;
+    if (map == MAP_FAILED)
+        return 0;
 
-    while ((line = read_dynamic_line(input, &line_length)) != NULL) {
-        if (line_length > 0 && line[line_length - 1] == '\n') {
-            line[line_length - 1] = '\0';
-            if (line[line_length - 2] == '\r') {
-                line[line_length - 2] = '\0';
-            }
-        }
+    const SnapshotHeader* h = (const SnapshotHeader*)map;
 
-        if (line[0] == '\0') {
-            free(line);
-            cnt_free++;
-            continue;
-        }
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0
+        || h->version != SNAPSHOT_VERSION
+        || h->byte_order != SNAPSHOT_BYTE_ORDER
+        || h->record_size != sizeof(SnapshotRecord)
+        || h->count > (size - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord)
+        || h->strings_size != size - sizeof(SnapshotHeader) - h->count * sizeof(SnapshotRecord)) {
+        munmap(map, size);
+        return 0;
+    }
 
-        if (strncmp(line, "insert", 6) == 0 && line[6] == ' ') {
-            insert_db(line, output, queue);
+    const SnapshotRecord* records = (const SnapshotRecord*)(h + 1);
+    const char* strings = (const char*)(records + h->count);
 
-        } else if (strncmp(line, "select", 6) == 0 && line[6] == ' ') {
-            select_db(line, output, queue);
+    if (h->strings_size > 0 && strings[h->strings_size - 1] != '\0') {
+        munmap(map, size);
+        return 0;
+    }
 
-        } else if (strncmp(line, "delete", 6) == 0 && line[6] == ' ') {
-            delete_db(line, output, queue);
+    madvise(map, size, MADV_SEQUENTIAL);
 
-        } else if (strncmp(line, "update", 6) == 0 && line[6] == ' ') {
-            update_db(line, output, queue);
+    if (h->count >= UINT_MAX || !reserve_rows(q, (unsigned int)h->count))
+        goto error;
 
-        } else if (strncmp(line, "uniq", 4) == 0 && line[4] == ' ') {
-            uniq_db(line, output, queue);
+    for (uint64_t i = 0; i < h->count; i++) {
+        const SnapshotRecord* r = &records[i];
 
-        } else if (strncmp(line, "sort", 4) == 0 && line[4] == ' ') {
-            sort_db(line, output, queue);
+        if (r->unit_model >= h->strings_size || r->carnum >= h->strings_size
+            || r->mechanic >= h->strings_size || r->driver >= h->strings_size
+            || r->status < 0 || r->status >= MAX_STATUS)
+            goto error;
 
-        } else {
-            fprintf(output, "incorrect:'%.20s'\n", line);
-        }
+        Node* n = alloc_node(&q->pool);
+        if (!n)
+            goto error;
 
-        free(line);
-        cnt_free++;
+        n->unit_id = r->unit_id;
+        n->chk_date.day = r->chk_date % 100;
+        n->chk_date.month = r->chk_date / 100 % 100;
+        n->chk_date.year = r->chk_date / 10000;
+        n->status = (Status)r->status;
+        n->unit_model = strings + r->unit_model;
+        n->carnum = strings + r->carnum;
+        n->mechanic = strings + r->mechanic;
+        n->driver = strings + r->driver;
+        n->car_key = r->car_key;
+        n->begin = 0;
+        n->end = VERSION_LIVE;
+        n->older = NULL;
+        q->rows[q->next_rid] = n;
+        n->rid = q->next_rid++;
+        n->next = NULL;
+        n->prev = q->tail;
+
+        if (q->head == NULL)
+            q->head = n;
+        else
+            q->tail->next = n;
+
+        q->tail = n;
     }
+
+    q->size = h->queue_size;
+    q->lsn = h->lsn;
+    q->strings.mapped = map;
+    q->strings.mapped_size = size;
+
+    // the indexes are built by the first query that can use them
+    q->id_index.broken = 1;
+    q->date_index.broken = 1;
+    q->status_index.broken = 1;
+    return 1;
+
+error:
+    free_db(q);
+    munmap(map, size);
+    return 0;
 }
 
-void free_db(struct Queue* queue) {
-    struct Node* current = queue->head;
-    struct Node* next;
-    while (current != NULL) {
-        next = current->next;
-        free(current);
-        cnt_free++;
-        current = next;
+// reads the command line, returns 0 on an unknown option
+int parse_options(int argc, char** argv, Options* opt) {
+    opt->load_path = NULL;
+    opt->save_path = NULL;
+    opt->wal_path = NULL;
+    opt->wal_group = WAL_DEFAULT_GROUP;
+    opt->threads = 1;
+    opt->sort_threshold = PARALLEL_SORT_ROWS;
+    opt->mmap_output = 0;
+    opt->stats_path = NULL;
+    opt->socket_path = NULL;
+    opt->stdio = 0;
+    opt->readers = 0;
+    opt->pipeline = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+            opt->load_path = argv[++i];
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+            opt->save_path = argv[++i];
+        else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc)
+            opt->wal_path = argv[++i];
+        else if (strcmp(argv[i], "--wal-group") == 0 && i + 1 < argc && parse_int(argv[i + 1], &opt->wal_group)
+            && opt->wal_group > 0)
+            i++;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && parse_int(argv[i + 1], &opt->threads)
+            && opt->threads > 0)
+            i++;
+        else if (strcmp(argv[i], "--sort-threshold") == 0 && i + 1 < argc
+            && parse_int(argv[i + 1], &opt->sort_threshold) && opt->sort_threshold > 0)
+            i++;
+        else if (strcmp(argv[i], "--mmap-output") == 0)
+            opt->mmap_output = 1;
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            opt->stats_path = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            opt->socket_path = argv[++i];
+        else if (strcmp(argv[i], "--stdio") == 0)
+            opt->stdio = 1;
+        else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc && parse_int(argv[i + 1], &opt->readers)
+            && opt->readers >= 0)
+            i++;
+        else if (strcmp(argv[i], "--pipeline") == 0)
+            opt->pipeline = 1;
+        else
+            return 0;
     }
 
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->size = 0;
+    // a server writes its results to the clients, not to output.txt
+    if ((opt->socket_path || opt->stdio) && (opt->mmap_output || opt->pipeline || (opt->socket_path && opt->stdio)))
+        return 0;
 
+    // only the socket server has other clients to go on with while a select runs
+    if (opt->readers && !opt->socket_path)
+        return 0;
+
+    // results written into a mapping reach the file before their log group is durable
+    return !(opt->mmap_output && opt->wal_path);
 }
 
-int main(void) {
-    FILE* input = fopen("input.txt", "r");
-    FILE* output = fopen("output.txt", "w");
+// the benchmark includes this file and brings its own main
+#ifndef LAB_DB_NO_MAIN
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_options(argc, argv, &opt)) {
+        fprintf(stderr, "usage: %s [--load snapshot] [--save snapshot] [--wal log] [--wal-group n] [--threads n] [--sort-threshold rows] [--mmap-output] [--stats file] [--pipeline | --serve socket [--readers n] | --stdio]\n", argv[0]);
+        return 1;
+    }
+
+    // a server reads its commands from the clients and leaves input.txt and output.txt alone
+    int serving = opt.socket_path || opt.stdio;
+
+    Writer output;
+    FILE* input = NULL;
+    int output_open = 1;
+
+    if (serving) {
+        writer_sink(&output);
+    } else {
+        input = fopen("input.txt", "r");
+        output_open = writer_open(&output, "output.txt", opt.mmap_output);
+
+        // with a log the results wait until their group is durable
+        output.hold = opt.wal_path != NULL;
+    }
+
     FILE* memstat = fopen("memstat.txt", "w");
-    if (!input || !output || !memstat) {
+    if ((!serving && !input) || !output_open || !memstat) {
         if (input) fclose(input);
-        if (output) fclose(output);
+        if (output_open) writer_close(&output);
         if (memstat) fclose(memstat);
         return 1;
     }
@@ -1507,18 +7224,105 @@ int main(void) {
     struct Queue queue;
     init_queue(&queue);
 
-    read_input(input, output, &queue);
+    if (opt.load_path && !load_snapshot(opt.load_path, &queue)) {
+        fprintf(stderr, "cannot load snapshot %s\n", opt.load_path);
+        if (input) fclose(input);
+        writer_close(&output);
+        fclose(memstat);
+        return 1;
+    }
+
+    Wal wal;
+    wal.fd = -1;
+    wal.buf = NULL;
+
+    if (opt.wal_path && !wal_open(&wal, opt.wal_path, opt.wal_group, &queue)) {
+        fprintf(stderr, "cannot replay write-ahead log %s\n", opt.wal_path);
+        wal_close(&wal);
+        free_plan_cache(&plan_cache);
+        free_db(&queue);
+        if (input) fclose(input);
+        writer_close(&output);
+        fclose(memstat);
+        return 1;
+    }
+
+    pool_start(&thread_pool, opt.threads);
+    readers_start(&reader_pool, opt.readers);
+    parallel_sort_rows = opt.sort_threshold;
+
+    InputReader reader;
+    Stats stats;
+    memset(&stats, 0, sizeof(Stats));
+
+    if (serving) {
+        if (!serve(&queue, opt.wal_path ? &wal : NULL, opt.stats_path ? &stats : NULL, opt.socket_path))
+            fprintf(stderr, "cannot serve on %s\n", opt.socket_path ? opt.socket_path : "stdin");
+    } else if (input_open(&reader, input)) {
+        if (opt.pipeline)
+            pipeline_input(&reader, &output, &queue, opt.wal_path ? &wal : NULL, opt.stats_path ? &stats : NULL);
+        else
+            read_input(&reader, &output, &queue, opt.wal_path ? &wal : NULL, opt.stats_path ? &stats : NULL);
+        input_close(&reader);
+    } else {
+        fprintf(stderr, "cannot read input.txt\n");
+    }
+
+    pool_stop(&thread_pool);
+    readers_stop(&reader_pool);
+    free_plan_cache(&plan_cache);
+
+    if (opt.stats_path && !write_stats(opt.stats_path, &stats))
+        fprintf(stderr, "cannot write stats %s\n", opt.stats_path);
+
+    if (opt.save_path) {
+        if (!save_snapshot(opt.save_path, &queue))
+            fprintf(stderr, "cannot save snapshot %s\n", opt.save_path);
+        else if (opt.wal_path && !wal_checkpoint(&wal))
+            fprintf(stderr, "cannot truncate write-ahead log %s\n", opt.wal_path);
+    }
+
+    NodePool pool = queue.pool;
+    long versions = queue.versions.versions;
+    size_t arena_bytes = queue.strings.bytes;
+    size_t arena_free_bytes = queue.strings.free_bytes;
 
     free_db(&queue);
+    wal_close(&wal);
+
+    if (!writer_close(&output))
+        fprintf(stderr, "cannot write output.txt\n");
 
     fprintf(memstat, "malloc:%d\n", cnt_malloc);
     fprintf(memstat, "strdup:%d\n", cnt_strdup);
     fprintf(memstat, "realloc:%d\n", cnt_realloc);
-    fprintf(memstat, "free:%d", cnt_free);
+    fprintf(memstat, "free:%d\n", cnt_free);
+    fprintf(memstat, "slabs:%d\n", pool.slab_count);
+    fprintf(memstat, "live_records:%d\n", pool.live);
+    fprintf(memstat, "free_list:%d\n", pool.free_count);
+    fprintf(memstat, "reserved_bytes:%zu\n", (size_t)pool.slab_count * sizeof(Slab));
+    fprintf(memstat, "arena_bytes:%zu\n", arena_bytes);
+    fprintf(memstat, "arena_free_bytes:%zu\n", arena_free_bytes);
+    fprintf(memstat, "plan_hits:%ld\n", plan_cache.hits);
+    fprintf(memstat, "plan_misses:%ld\n", plan_cache.misses);
+
+    if (opt.wal_path) {
+        fprintf(memstat, "wal_records:%ld\n", wal.records);
+        fprintf(memstat, "wal_bytes:%llu\n", (unsigned long long)wal.bytes);
+        fprintf(memstat, "wal_syncs:%ld\n", wal.syncs);
+        fprintf(memstat, "wal_time_us:%llu\n", (unsigned long long)(wal.time_ns / 1000));
+    }
+
+    if (opt.readers) {
+        fprintf(memstat, "snapshot_reads:%ld\n", reader_pool.reads);
+        fprintf(memstat, "row_versions:%ld\n", versions);
+    }
+
+    write_alloc_stats(memstat);
 
-    fclose(input);
-    fclose(output);
+    if (input) fclose(input);
     fclose(memstat);
 
     return 0;
 }
+#endif
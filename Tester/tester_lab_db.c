@@ -8,7 +8,7 @@
 
 #define EXECUTABLE "./Simply-DataBase/DataBase/lab_db"
 
-#define NUM_TESTS 5
+#define NUM_TESTS 8
 
 static void make_test_filename(char* buffer, size_t size, const char* folder, const char* base, int num) {
     snprintf(buffer, size, "./%s/%s %d.txt", folder, base, num);